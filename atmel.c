@@ -0,0 +1,30 @@
+#include "atmel.h"
+
+// test if AT89S or AVR chip
+bool at89s(uint32_t sig)
+{
+    return (sig & 0xf000) == 0x5000 || (sig & 0xf000) == 0x7000;
+}
+
+// Atmel Signature => Flash Size
+size_t atmel_flashsize(uint32_t sig)
+{
+    unsigned nib2 = (sig >> 8) & 0xf;
+    return at89s(sig) ? (nib2 << 12) : (1024U << nib2);
+}
+
+// Atmel Flash Size => Page Size
+size_t atmel_pagesize(uint32_t sig, size_t fsz)
+{
+    if ((sig & 0xf000) == 0x5000)
+        return 256;
+    if ((sig & 0xf000) == 0x7000)
+        return 64;
+    if (fsz <= 2048)
+        return 32;
+    if (fsz <= 8192)
+        return 64;
+    if (fsz <= 32768)
+        return 128;
+    return 256;
+}
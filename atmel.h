@@ -0,0 +1,16 @@
+#if !defined(ATMEL_H)
+#define ATMEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// device signature rules shared by avrtool and avrsim
+bool at89s(uint32_t sig);
+size_t atmel_flashsize(uint32_t sig);
+size_t atmel_pagesize(uint32_t sig, size_t fsz);
+// uint32_t sig = 0x1e950f;    // ATmega328P
+// size_t fsz = atmel_flashsize(sig);          // 32768
+// size_t psz = atmel_pagesize(sig, fsz);      // 128
+
+#endif // ATMEL_H
@@ -0,0 +1,334 @@
+//
+// avrproxy
+//
+// Serial link emulator between a pseudo-terminal and a serial device
+// Adds latency, bandwidth cap, jitter and byte faults in both directions
+//
+// https://github.com/matveyt/avrtool
+//
+
+#define _XOPEN_SOURCE 600
+#include "stdz.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// one transfer in flight
+struct packet {
+    struct packet* next;
+    uint64_t due;       // delivery time (us)
+    size_t length;
+    uint8_t data[];
+};
+
+// one direction of the link
+struct link {
+    const char* name;
+    int from, to;
+    unsigned latency;   // per transfer (us)
+    uint64_t line_free; // bandwidth cap: wire is busy until (us)
+    uint64_t last_due;  // keep order
+    struct packet *head, *tail;
+    unsigned long bytes, transfers, dropped, corrupted;
+};
+
+// user options
+static struct {
+    char* device;
+    unsigned baud;      // 0 = no bandwidth cap
+    unsigned latency;   // replies (us)
+    unsigned tx_latency;    // commands (us)
+    unsigned jitter;    // max. extra latency (us)
+    double drop, corrupt;   // probability per byte
+    unsigned seed;
+    bool verbose;
+} opt = { .latency = 1000, .tx_latency = 1000, .seed = 1 };
+
+static volatile sig_atomic_t quit;
+
+static uint64_t usec(void);
+static unsigned msec_arg(const char* arg);
+static void raw_mode(int fd);
+static bool chance(double p);
+static bool forward(struct link* lk, uint64_t now);
+static void deliver(struct link* lk, uint64_t now);
+static void on_signal(int sig);
+
+/*noreturn*/
+static void usage(int status)
+{
+    if (status != 0)
+        fprintf(stderr, "Try '%s --help' for more information.\n", z_getprogname());
+    else
+        printf(
+"Usage: %s [OPTION]... DEVICE\n"
+"Serial link emulator. Print pseudo-terminal name and relay it to DEVICE.\n"
+"\n"
+"-b, --baud=BAUD        Cap bandwidth at BAUD (8N1)\n"
+"-l, --latency=MS       Delay per transfer from DEVICE (default 1)\n"
+"-L, --tx-latency=MS    Delay per transfer to DEVICE (default 1)\n"
+"-j, --jitter=MS        Add random delay up to MS per transfer\n"
+"-D, --drop=P           Drop byte with probability P\n"
+"-C, --corrupt=P        Flip a bit with probability P per byte\n"
+"-s, --seed=NUM         Random seed (default 1)\n"
+"-v, --verbose          Show link statistics on exit\n"
+"-h, --help             Show this message and exit\n",
+        z_getprogname());
+    exit(status);
+}
+
+static void parse_args(int argc, char* argv[])
+{
+    z_setprogname(argv[0]);
+
+    static struct z_option lopts[] = {
+        { "baud", z_required_argument, NULL, 'b' },
+        { "latency", z_required_argument, NULL, 'l' },
+        { "tx-latency", z_required_argument, NULL, 'L' },
+        { "jitter", z_required_argument, NULL, 'j' },
+        { "drop", z_required_argument, NULL, 'D' },
+        { "corrupt", z_required_argument, NULL, 'C' },
+        { "seed", z_required_argument, NULL, 's' },
+        { "verbose", z_no_argument, NULL, 'v' },
+        { "help", z_no_argument, NULL, 'h' },
+        {0}
+    };
+
+    int c;
+    while ((c = z_getopt_long(argc, argv, "b:l:L:j:D:C:s:vh", lopts, NULL)) != -1) {
+        switch (c) {
+        case 'b':
+            opt.baud = strtoul(z_optarg, NULL, 10);
+        break;
+        case 'l':
+            opt.latency = msec_arg(z_optarg);
+        break;
+        case 'L':
+            opt.tx_latency = msec_arg(z_optarg);
+        break;
+        case 'j':
+            opt.jitter = msec_arg(z_optarg);
+        break;
+        case 'D':
+            opt.drop = strtod(z_optarg, NULL);
+        break;
+        case 'C':
+            opt.corrupt = strtod(z_optarg, NULL);
+        break;
+        case 's':
+            opt.seed = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'v':
+            opt.verbose = true;
+        break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+        break;
+        case '?':
+            usage(EXIT_FAILURE);
+        break;
+        }
+    }
+
+    if (z_optind != argc - 1)
+        usage(EXIT_FAILURE);
+    opt.device = z_strdup(argv[z_optind]);
+}
+
+int main(int argc, char* argv[])
+{
+    parse_args(argc, argv);
+    srand(opt.seed);
+
+    int dev = open(opt.device, O_RDWR | O_NOCTTY);
+    if (dev < 0)
+        z_error(EXIT_FAILURE, errno, "%s", opt.device);
+    raw_mode(dev);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+        z_error(EXIT_FAILURE, errno, "posix_openpt");
+    const char* name = ptsname(master);
+    if (name == NULL)
+        z_error(EXIT_FAILURE, errno, "ptsname");
+    // keep slave open, so master does not get EIO between clients
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave < 0)
+        z_error(EXIT_FAILURE, errno, "%s", name);
+    raw_mode(slave);
+
+    // no SA_RESTART, so poll() returns
+    struct sigaction sa = {0};
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("%s\n", name);
+    fflush(stdout);
+
+    struct link lk[2] = {
+        { .name = "commands", .from = master, .to = dev, .latency = opt.tx_latency },
+        { .name = "replies", .from = dev, .to = master, .latency = opt.latency },
+    };
+    while (!quit) {
+        // sleep until next delivery
+        uint64_t now = usec();
+        int timeout = -1;
+        for (size_t i = 0; i < 2; ++i) {
+            if (lk[i].head == NULL)
+                continue;
+            uint64_t delay = (lk[i].head->due > now) ? lk[i].head->due - now : 0;
+            int ms = (int)((delay + 999) / 1000);
+            if (timeout < 0 || ms < timeout)
+                timeout = ms;
+        }
+        struct pollfd pfd[2] = { { master, POLLIN, 0 }, { dev, POLLIN, 0 } };
+        if (poll(pfd, 2, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            z_error(EXIT_FAILURE, errno, "poll");
+        }
+
+        now = usec();
+        for (size_t i = 0; i < 2; ++i)
+            if (pfd[i].revents != 0 && !forward(&lk[i], now))
+                quit = 1;   // device is gone
+        for (size_t i = 0; i < 2; ++i)
+            deliver(&lk[i], usec());
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        if (opt.verbose)
+            z_warnx("%s: %lu bytes, %lu transfers, %lu dropped, %lu corrupted",
+                lk[i].name, lk[i].bytes, lk[i].transfers, lk[i].dropped,
+                lk[i].corrupted);
+        while (lk[i].head != NULL) {
+            struct packet* next = lk[i].head->next;
+            free(lk[i].head);
+            lk[i].head = next;
+        }
+    }
+    close(slave);
+    close(master);
+    close(dev);
+    free(opt.device);
+    return EXIT_SUCCESS;
+}
+
+// monotonic clock (us)
+uint64_t usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// parse milliseconds (may be fractional) into microseconds
+unsigned msec_arg(const char* arg)
+{
+    double ms = strtod(arg, NULL);
+    return (ms > 0) ? (unsigned)(ms * 1000 + 0.5) : 0;
+}
+
+// no line discipline
+void raw_mode(int fd)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL
+            | IXON);
+        tio.c_oflag &= ~OPOST;
+        tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+        tio.c_cflag = (tio.c_cflag & ~(CSIZE | PARENB)) | CS8 | CLOCAL | CREAD;
+        tio.c_cc[VMIN] = 1;
+        tio.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+}
+
+// random event
+bool chance(double p)
+{
+    return p > 0 && rand() < p * ((double)RAND_MAX + 1);
+}
+
+// read available bytes and queue them for delivery
+// return false on EOF
+bool forward(struct link* lk, uint64_t now)
+{
+    uint8_t buffer[4096];
+    ssize_t n = read(lk->from, buffer, sizeof(buffer));
+    if (n < 0)
+        return errno == EINTR || errno == EAGAIN;
+    if (n == 0)
+        return false;
+
+    struct packet* pkt = (struct packet*)z_malloc(sizeof(struct packet) + n);
+    size_t len = 0;
+    for (ssize_t i = 0; i < n; ++i) {
+        if (chance(opt.drop)) {
+            ++lk->dropped;
+            continue;
+        }
+        pkt->data[len] = buffer[i];
+        if (chance(opt.corrupt)) {
+            pkt->data[len] ^= 1 << (rand() % 8);
+            ++lk->corrupted;
+        }
+        ++len;
+    }
+    lk->bytes += n;
+    ++lk->transfers;
+
+    // wire time, then transfer latency
+    if (opt.baud > 0)
+        lk->line_free = max(lk->line_free, now) + (uint64_t)n * 10000000 / opt.baud;
+    else
+        lk->line_free = now;
+    uint64_t due = lk->line_free + lk->latency;
+    if (opt.jitter > 0)
+        due += (uint64_t)rand() % (opt.jitter + 1);
+    lk->last_due = max(lk->last_due, due);
+
+    pkt->next = NULL;
+    pkt->due = lk->last_due;
+    pkt->length = len;
+    if (lk->tail != NULL)
+        lk->tail->next = pkt;
+    else
+        lk->head = pkt;
+    lk->tail = pkt;
+    return true;
+}
+
+// write transfers that are due
+void deliver(struct link* lk, uint64_t now)
+{
+    while (lk->head != NULL && lk->head->due <= now) {
+        struct packet* pkt = lk->head;
+        for (size_t cnt = 0; cnt < pkt->length; ) {
+            ssize_t n = write(lk->to, &pkt->data[cnt], pkt->length - cnt);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                z_error(EXIT_FAILURE, errno, "write");
+            }
+            cnt += n;
+        }
+        lk->head = pkt->next;
+        if (lk->head == NULL)
+            lk->tail = NULL;
+        free(pkt);
+    }
+}
+
+// SIGINT, SIGTERM
+void on_signal(int sig)
+{
+    (void)sig;
+    quit = 1;
+}
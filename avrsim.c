@@ -0,0 +1,515 @@
+//
+// avrsim
+//
+// STK500v1 target emulator on a pseudo-terminal
+// Serves Optiboot, "Arduino as ISP" or AT89S from in-memory flash
+//
+// https://github.com/matveyt/avrtool
+//
+
+#define _XOPEN_SOURCE 600
+#include "stdz.h"
+#include "atmel.h"
+#include "isp.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CRC_EOP ' '
+// RDY/BSY time after chip erase and fuse write (us)
+#define ERASE_BUSY 9000
+#define FUSE_BUSY 4500
+// Optiboot page erase and write (us), input is lost meanwhile (see --busy-write)
+#define PAGE_BUSY 9000
+// bytes the UART holds while nobody reads it
+#define UART_FIFO 2
+
+enum { OPTIBOOT, ARDUINOISP, AT89S };
+
+// user options
+static struct {
+    int mode;
+    uint32_t sig;
+    size_t fsz, psz;
+    unsigned delay;     // service time per command (us)
+    unsigned wdelay;    // extra time per page write (us)
+    bool paged;         // AT89S: accept page transfers
+    bool busy_write;    // Optiboot: drop input while writing a page
+    bool verbose;
+    char* image;        // flash contents file
+} opt;
+
+static int master;                  // pty master
+static uint8_t* flash;
+static uint8_t fuse[4] = { 0x62, 0xd9, 0xff, 0xff };  // low-high-extended-lock
+static size_t address;              // byte address
+static uint64_t busy;               // RDY/BSY deadline
+static volatile sig_atomic_t quit;
+static struct {
+    uint8_t buf[4096];
+    size_t pos, len;
+} rx;                               // input read ahead
+static struct {
+    unsigned long commands, bytes_in, bytes_out, dropped;
+} stats;
+
+static uint64_t usec(void);
+static void sleep_us(unsigned us);
+static int get(void);
+static void overrun(void);
+static void put(const void* buffer, size_t length);
+static void serve(int ch);
+static uint8_t universal(const uint8_t b[4]);
+static void load_image(void);
+static void save_image(void);
+static void on_signal(int sig);
+
+/*noreturn*/
+static void usage(int status)
+{
+    if (status != 0)
+        fprintf(stderr, "Try '%s --help' for more information.\n", z_getprogname());
+    else
+        printf(
+"Usage: %s [OPTION]...\n"
+"STK500v1 target emulator. Print pseudo-terminal name and serve it until killed.\n"
+"\n"
+"-m, --mode=MODE        optiboot (default), arduinoisp or at89s\n"
+"-S, --signature=X      Device signature (default 1e950f, AT89S 1e5206)\n"
+"-f, --flash-size=NUM   Flash size (default by signature)\n"
+"-P, --page-size=NUM    Page size (default by signature)\n"
+"-t, --delay=US         Service time per command\n"
+"-T, --write-delay=US   Extra service time per page write\n"
+"-g, --paged            AT89S: accept STK_READ_PAGE and STK_PROG_PAGE\n"
+"-B, --busy-write       Optiboot: drop input while writing a page (-T or 9 ms)\n"
+"-i, --image=FILE       Load flash from FILE, save it on leaving progmode\n"
+"-v, --verbose          Show command counts (since start) on leaving progmode\n"
+"-h, --help             Show this message and exit\n",
+        z_getprogname());
+    exit(status);
+}
+
+static void parse_args(int argc, char* argv[])
+{
+    z_setprogname(argv[0]);
+
+    static struct z_option lopts[] = {
+        { "mode", z_required_argument, NULL, 'm' },
+        { "signature", z_required_argument, NULL, 'S' },
+        { "flash-size", z_required_argument, NULL, 'f' },
+        { "page-size", z_required_argument, NULL, 'P' },
+        { "delay", z_required_argument, NULL, 't' },
+        { "write-delay", z_required_argument, NULL, 'T' },
+        { "paged", z_no_argument, NULL, 'g' },
+        { "busy-write", z_no_argument, NULL, 'B' },
+        { "image", z_required_argument, NULL, 'i' },
+        { "verbose", z_no_argument, NULL, 'v' },
+        { "help", z_no_argument, NULL, 'h' },
+        {0}
+    };
+
+    int c;
+    while ((c = z_getopt_long(argc, argv, "m:S:f:P:t:T:gBi:vh", lopts, NULL)) != -1) {
+        switch (c) {
+        case 'm':
+            if (z_strcasecmp(z_optarg, "optiboot") == 0)
+                opt.mode = OPTIBOOT;
+            else if (z_strcasecmp(z_optarg, "arduinoisp") == 0)
+                opt.mode = ARDUINOISP;
+            else if (z_strcasecmp(z_optarg, "at89s") == 0)
+                opt.mode = AT89S;
+            else
+                z_error(EXIT_FAILURE, EINVAL, "%s", z_optarg);
+        break;
+        case 'S':
+            opt.sig = strtoul(z_optarg, NULL, 16);
+        break;
+        case 'f':
+            opt.fsz = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'P':
+            opt.psz = strtoul(z_optarg, NULL, 0);
+        break;
+        case 't':
+            opt.delay = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'T':
+            opt.wdelay = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'g':
+            opt.paged = true;
+        break;
+        case 'B':
+            opt.busy_write = true;
+        break;
+        case 'i':
+            opt.image = z_strdup(z_optarg);
+        break;
+        case 'v':
+            opt.verbose = true;
+        break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+        break;
+        case '?':
+            usage(EXIT_FAILURE);
+        break;
+        }
+    }
+    if (z_optind != argc)
+        usage(EXIT_FAILURE);
+
+    // same rules as avrtool uses to guess device
+    if (opt.sig == 0)
+        opt.sig = (opt.mode == AT89S) ? 0x1e5206 : 0x1e950f;
+    if (opt.fsz == 0)
+        opt.fsz = atmel_flashsize(opt.sig);
+    if (opt.psz == 0)
+        opt.psz = atmel_pagesize(opt.sig, opt.fsz);
+    if (opt.fsz == 0 || opt.psz == 0 || opt.psz > opt.fsz)
+        z_error(EXIT_FAILURE, EINVAL, "flash %zu, page %zu", opt.fsz, opt.psz);
+}
+
+int main(int argc, char* argv[])
+{
+    parse_args(argc, argv);
+    flash = (uint8_t*)memset(z_malloc(opt.fsz), 0xff, opt.fsz);
+    load_image();
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+        z_error(EXIT_FAILURE, errno, "posix_openpt");
+    const char* name = ptsname(master);
+    if (name == NULL)
+        z_error(EXIT_FAILURE, errno, "ptsname");
+
+    // keep slave open, so master does not get EIO between clients
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave < 0)
+        z_error(EXIT_FAILURE, errno, "%s", name);
+    struct termios tio;
+    if (tcgetattr(slave, &tio) == 0) {
+        tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL
+            | IXON);
+        tio.c_oflag &= ~OPOST;
+        tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+        tio.c_cflag = (tio.c_cflag & ~(CSIZE | PARENB)) | CS8;
+        tcsetattr(slave, TCSANOW, &tio);
+    }
+
+    // no SA_RESTART, so blocking read() returns
+    struct sigaction sa = {0};
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("%s\n", name);
+    fflush(stdout);
+
+    for (int ch; (ch = get()) != EOF; )
+        serve(ch);
+
+    save_image();
+    close(slave);
+    close(master);
+    free(flash);
+    free(opt.image);
+    return EXIT_SUCCESS;
+}
+
+// monotonic clock (us)
+uint64_t usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// sleep (us)
+void sleep_us(unsigned us)
+{
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000L };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !quit)
+        ;
+}
+
+// read byte from host
+// return EOF on signal
+int get(void)
+{
+    while (rx.pos == rx.len) {
+        if (quit)
+            return EOF;
+        ssize_t n = read(master, rx.buf, sizeof(rx.buf));
+        if (n < 0 && errno != EINTR)
+            z_error(EXIT_FAILURE, errno, "read");
+        rx.pos = 0;
+        rx.len = (n > 0) ? (size_t)n : 0;
+        stats.bytes_in += rx.len;
+    }
+    return rx.buf[rx.pos++];
+}
+
+// input not read while busy: UART keeps the first bytes, the rest is lost
+void overrun(void)
+{
+    memmove(rx.buf, &rx.buf[rx.pos], rx.len - rx.pos);
+    rx.len -= rx.pos;
+    rx.pos = 0;
+    if (rx.len > UART_FIFO) {
+        stats.dropped += rx.len - UART_FIFO;
+        rx.len = UART_FIFO;
+    }
+
+    // arrived while busy
+    uint8_t late[sizeof(rx.buf)];
+    struct pollfd pfd = { .fd = master, .events = POLLIN };
+    while (poll(&pfd, 1, 0) > 0) {
+        ssize_t n = read(master, late, sizeof(late));
+        if (n <= 0)
+            break;
+        size_t keep = min((size_t)n, UART_FIFO - rx.len);
+        memcpy(&rx.buf[rx.len], late, keep);
+        rx.len += keep;
+        stats.bytes_in += n;
+        stats.dropped += n - keep;
+    }
+}
+
+// write reply to host
+void put(const void* buffer, size_t length)
+{
+    const uint8_t* ptr = (const uint8_t*)buffer;
+    while (length > 0) {
+        ssize_t n = write(master, ptr, length);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            z_error(EXIT_FAILURE, errno, "write");
+        }
+        ptr += n;
+        length -= n;
+        stats.bytes_out += n;
+    }
+}
+
+// execute one STK500 command
+void serve(int ch)
+{
+    static uint8_t data[3 + 65536 + 1];
+    size_t nargs;
+    switch (ch) {
+    case '0':   // STK_GET_SYNC
+    case 'P':   // STK_ENTER_PROGMODE
+    case 'Q':   // STK_LEAVE_PROGMODE
+    case 'R':   // STK_CHIP_ERASE
+    case 'u':   // STK_READ_SIGN
+        nargs = 0;
+    break;
+    case 'B':   // STK_SET_DEVICE
+        nargs = 20;
+    break;
+    case 'U':   // STK_LOAD_ADDRESS
+        nargs = 2;
+    break;
+    case 't':   // STK_READ_PAGE
+    case 'd':   // STK_PROG_PAGE
+        nargs = 3;
+    break;
+    case 'V':   // STK_UNIVERSAL
+        nargs = 4;
+    break;
+    default:
+        put((uint8_t[]){ STK_UNKNOWN }, 1);
+        return;
+    }
+
+    ++stats.commands;
+    for (size_t i = 0; i < nargs; ++i) {
+        int b = get();
+        if (b == EOF)
+            return;
+        data[i] = b;
+    }
+    size_t length = (nargs == 3) ? (size_t)(data[0] << 8 | data[1]) : 0;
+    if (ch == 'd') {
+        for (size_t i = 0; i < length; ++i) {
+            int b = get();
+            if (b == EOF)
+                return;
+            data[3 + i] = b;
+        }
+    }
+    if (get() != CRC_EOP) {
+        put((uint8_t[]){ STK_NOSYNC }, 1);
+        return;
+    }
+    if (opt.delay > 0)
+        sleep_us(opt.delay);
+
+    uint8_t resp[3 + 65536];
+    size_t n = 0;
+    resp[n++] = STK_INSYNC;
+    switch (ch) {
+    case 'Q':
+        save_image();
+        if (opt.verbose)
+            z_warnx("%lu commands, %lu bytes in, %lu bytes out, %lu dropped",
+                stats.commands, stats.bytes_in, stats.bytes_out, stats.dropped);
+    break;
+    case 'R':
+        // bootloaders fake it
+        if (opt.mode != OPTIBOOT) {
+            memset(flash, 0xff, opt.fsz);
+            busy = usec() + ERASE_BUSY;
+        }
+    break;
+    case 'u':
+        // "Arduino as ISP" reads AVR signature, AT89S returns nothing
+        for (int i = 16; i >= 0; i -= 8)
+            resp[n++] = (opt.mode == AT89S) ? 0 : (uint8_t)(opt.sig >> i);
+    break;
+    case 'U':
+        address = (size_t)(data[0] | data[1] << 8) * 2;
+    break;
+    case 't':
+    case 'd':
+        if (opt.mode == AT89S && !opt.paged) {
+            // byte mode only
+            put((uint8_t[]){ STK_FAILED }, 1);
+            return;
+        }
+        if (data[2] != 'F') {
+            // no EEPROM
+            if (ch == 't') {
+                memset(&resp[n], 0xff, length);
+                n += length;
+            }
+            break;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            size_t a = (address + i) % opt.fsz;
+            if (ch == 't')
+                resp[n++] = flash[a];
+            else if (opt.mode == OPTIBOOT)
+                flash[a] = data[3 + i];     // page erase and write
+            else
+                flash[a] &= data[3 + i];    // write only
+        }
+        if (ch == 'd' && opt.mode == OPTIBOOT && opt.busy_write) {
+            sleep_us((opt.wdelay > 0) ? opt.wdelay : PAGE_BUSY);
+            overrun();
+        } else if (ch == 'd' && opt.wdelay > 0) {
+            sleep_us(opt.wdelay);
+        }
+    break;
+    case 'V':
+        resp[n++] = universal(data);
+    break;
+    }
+    resp[n++] = STK_OK;
+    put(resp, n);
+}
+
+// STK_UNIVERSAL: SPI instruction
+uint8_t universal(const uint8_t b[4])
+{
+    size_t a = (b[1] << 8 | b[2]) % opt.fsz;
+    uint8_t sig[] = { opt.sig >> 16, opt.sig >> 8, opt.sig };
+
+    if (opt.mode == OPTIBOOT) {
+        // Optiboot ignores it
+        return 0;
+    } else if (opt.mode == AT89S) {
+        switch (b[0]) {
+        case 0x20:  // read byte
+            return flash[a];
+        case 0x40:  // write byte
+            flash[a] &= b[3];
+        break;
+        case 0x24:  // read lock bits
+            return fuse[3];
+        case 0x28:  // read signature
+            return (b[1] < 3) ? sig[b[1]] : 0;
+        case 0xac:
+            if (b[1] == 0x80)
+                memset(flash, 0xff, opt.fsz);
+        break;
+        }
+        return 0;
+    }
+
+    switch (b[0]) {
+    case 0x20:  // read low byte
+    case 0x28:  // read high byte
+        return flash[(a * 2 + (b[0] == 0x28)) % opt.fsz];
+    case 0x30:  // read signature
+        return sig[b[2] % 3];
+    case 0x50:  // read low or extended fuse
+        return fuse[(b[1] == 8) ? 2 : 0];
+    case 0x58:  // read high fuse or lock
+        return fuse[(b[1] == 8) ? 1 : 3];
+    case 0xac:
+        switch (b[1]) {
+        case 0x80:  // chip erase
+            memset(flash, 0xff, opt.fsz);
+            busy = usec() + ERASE_BUSY;
+            return 0;
+        case 0xa0:
+            fuse[0] = b[3];
+        break;
+        case 0xa8:
+            fuse[1] = b[3];
+        break;
+        case 0xa4:
+            fuse[2] = b[3];
+        break;
+        case 0xe0:
+            fuse[3] = b[3];
+        break;
+        default:
+            return 0;
+        }
+        busy = usec() + FUSE_BUSY;
+    break;
+    case 0xf0:  // poll RDY/BSY
+        return usec() < busy;
+    }
+    return 0;
+}
+
+// load flash contents (missing file is blank)
+void load_image(void)
+{
+    if (opt.image == NULL)
+        return;
+    FILE* f = fopen(opt.image, "rb");
+    if (f != NULL) {
+        size_t n = fread(flash, 1, opt.fsz, f);
+        (void)n;
+        fclose(f);
+    }
+}
+
+// save flash contents
+void save_image(void)
+{
+    if (opt.image == NULL)
+        return;
+    FILE* f = fopen(opt.image, "wb");
+    if (f == NULL || fwrite(flash, 1, opt.fsz, f) != opt.fsz)
+        z_warnx("%s: %s", opt.image, strerror(errno));
+    if (f != NULL)
+        fclose(f);
+}
+
+// SIGINT, SIGTERM
+void on_signal(int sig)
+{
+    (void)sig;
+    quit = 1;
+}
@@ -7,37 +7,133 @@
 // https://github.com/matveyt/avrtool
 //
 
+#define _POSIX_C_SOURCE 200809L
 #include "stdz.h"
+#include "atmel.h"
 #include "ihx.h"
 #include "isp.h"
 #include "ucomm.h"
 
+#if defined(__unix__)
+#include <glob.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+#include <signal.h>
+
+// STK_GET_SYNC response time (ms)
+#define SYNC_TIMEOUT 50
+// sync attempts per port in gang mode (~5 s)
+#define GANG_SYNC_TRIES 100
+// RDY/BSY polling deadlines (ms)
+#define ERASE_TIMEOUT 500
+#define FUSE_TIMEOUT 100
+// --baud=auto: sync attempts per rate and how many must succeed in a row
+#define AUTOBAUD_TRIES 20
+#define AUTOBAUD_SYNCS 3
+// AT89S: page mode tests while flash looks uniform (repeated after page writes)
+#define PAGE_MODE_PROBES 4
+
 struct isp_device {
     uint32_t sig;       // Signature bytes
     bool cmdV;          // STK_UNIVERSAL supported
+    bool paged;         // STK_READ_PAGE/STK_PROG_PAGE work (probed for AT89S)
+    unsigned probes;    // page mode undecided, tests left
     size_t fsz, psz;    // Flash Size and Page Size
 };
 
-static bool at89s(uint32_t sig);
-static size_t atmel_flashsize(uint32_t sig);
-static size_t atmel_pagesize(uint32_t sig, size_t fsz);
-static void isp_0(int ch, intptr_t fd);
-static uint8_t isp_v(int b1, int b2, int b3, int b4, intptr_t fd);
-static uint32_t isp_guess(struct isp_device* d, intptr_t fd);
+// streaming page assembler
+struct assembler {
+    struct isp_device* d;
+    intptr_t fd;
+    ISP_PIPE pp;
+    bool started;
+    size_t first;               // address of first record (image base)
+    size_t shift, limit;        // address shift and upper limit
+    const char* error;          // reason to stop parsing
+    uint8_t* pages;             // pages in flight
+    uint8_t* written;           // per page flags
+    size_t nsent, nblank, nrewrite;
+    struct {
+        bool used;
+        size_t address;
+        uint8_t* data;
+    } slot[4];
+};
+
+// double-buffered flash reader
+struct reader {
+    IHX_WRITER* pw;
+    intptr_t full, free;        // semaphores
+    struct {
+        size_t address, length;
+        uint8_t* data;
+    } chunk[4];
+};
+
+static int erase_chip(const struct isp_device* d, intptr_t fd);
+static int wait_ready(const struct isp_device* d, uint32_t ms, intptr_t fd);
+static int page_mode(struct isp_device* d, size_t address, intptr_t fd);
+static int read_flash(const struct isp_device* d, size_t address, uint8_t* buffer,
+    size_t length, const uint8_t* mask, intptr_t fd);
+static size_t mismatch(const uint8_t* buf1, const uint8_t* buf2, size_t length);
+static bool blank(const uint8_t* buffer, size_t length);
+static int prog_page(struct isp_device* d, size_t address, const uint8_t* page,
+    size_t length, ISP_PIPE* pp);
+static int write_image(struct isp_device* d, const IHX* image, intptr_t fd);
+static int write_pages(struct isp_device* d, const IHX* ihx, uint8_t* pages,
+    uint8_t* dirty, intptr_t fd);
+static int write_stream(struct isp_device* d, FILE* f, intptr_t fd);
+static void read_file(const struct isp_device* d, size_t address, size_t length,
+    FILE* f, intptr_t fd);
+static int isp_0(int ch, intptr_t fd);
+static int isp_v(int b1, int b2, int b3, int b4, intptr_t fd);
+static int isp_vn(const void* cmd, uint8_t* b_out, size_t n, intptr_t fd);
+static int isp_guess(struct isp_device* d, intptr_t fd);
 static void list_ports(void);
+static void target_reset(intptr_t fd);
+static size_t autobaud(intptr_t fd, size_t first);
+static int link_error(const char* fmt, ...);
+static void replay_check(intptr_t fd, const char* what);
+static void restore_link(void);
+static void restore_on_signal(int sig);
+static void add_port(const char* port);
+static int program(const char* port, const IHX* image);
+static int transfer(const IHX* image, intptr_t isp);
+static int gang(const IHX* image);
 
 // user options
 static struct {
     char* file;
-    char* port;
+    char** ports;       // more than one for gang mode
+    size_t nports;
     unsigned baud;
     int erase;          // >0 erase, <0 no erase, =0 auto
     size_t base, size;  // new image base and size
-    bool read, noreset;
+    bool read, noreset, diff, verify, stream, verbose;
+    bool autobaud;      // --baud=auto
+    bool low_latency;   // lower USB-serial latency while open
+    unsigned window;    // pipelined commands
+    unsigned wrap;      // Intel HEX record size
+    char* trace;        // record serial I/O
+    char* replay;       // play back recorded serial I/O
     int fuse_mask;
     uint8_t fuse[4];    // low-high-extended-lock
 } opt = {0};
 
+static bool erased;     // flash memory is blank
+static FILE* con;       // status messages
+static volatile intptr_t linked = -1;   // open port (restored on exit)
+
+// --baud=auto candidates (fastest first)
+static const unsigned rates[] = {
+    1000000, 500000, 250000, 230400, 115200, 57600, 38400, 19200
+};
+static size_t link_rate;        // index in rates[]
+static bool relink_armed;       // link errors start over at lower rate
+static char link_msg[128];      // last link error
+
 /*noreturn*/
 static void usage(int status)
 {
@@ -48,14 +144,23 @@ static void usage(int status)
 "Usage: %s [OPTION]... [FILE]\n"
 "STK500v1 serial programmer. Write HEX/BIN file to AVR/Arduino.\n"
 "\n"
-"-p, --port=PORT    Select serial device\n"
-"-b, --baud=BAUD    Transfer baud rate\n"
+"-p, --port=PORT    Select serial device (may repeat)\n"
+"-b, --baud=BAUD    Transfer baud rate (or \"auto\")\n"
 "-x, --erase        Always erase chip\n"
 "-X, --noerase      Never erase chip\n"
 "-a, --base=ADDR    Flash memory start address\n"
 "-z, --size=NUM     Flash memory maximum size\n"
 "-r, --read         Read memory to FILE\n"
+"    --wrap=NUM     Bytes per output record (max. 255)\n"
+"-d, --diff         Write changed pages only\n"
+"-V, --verify       Verify written memory (overlapped with --window)\n"
+"-s, --stream       Write pages while FILE is being read\n"
 "-n, --noreset      Do not assert DTR or RTS\n"
+"-v, --verbose      Show serial port details\n"
+"-w, --window=NUM   Keep NUM commands in flight\n"
+"    --low-latency  Lower USB-serial latency while open (Linux)\n"
+"    --trace=FILE   Record serial I/O to FILE\n"
+"    --replay=FILE  Play back FILE instead of serial port\n"
 "    --lfuse=X      Set low fuse\n"
 "    --hfuse=X      Set high fuse\n"
 "    --efuse=X      Set extended fuse\n"
@@ -78,7 +183,16 @@ static void parse_args(int argc, char* argv[])
         { "base", z_required_argument, NULL, 'a' },
         { "size", z_required_argument, NULL, 'z' },
         { "read", z_no_argument, NULL, 'r' },
+        { "wrap", z_required_argument, NULL, 4 },
+        { "diff", z_no_argument, NULL, 'd' },
+        { "verify", z_no_argument, NULL, 'V' },
+        { "stream", z_no_argument, NULL, 's' },
         { "noreset", z_no_argument, NULL, 'n' },
+        { "verbose", z_no_argument, NULL, 'v' },
+        { "window", z_required_argument, NULL, 'w' },
+        { "trace", z_required_argument, NULL, 5 },
+        { "replay", z_required_argument, NULL, 6 },
+        { "low-latency", z_no_argument, NULL, 7 },
         { "lfuse", z_required_argument, NULL, 0 },
         { "hfuse", z_required_argument, NULL, 1 },
         { "efuse", z_required_argument, NULL, 2 },
@@ -89,13 +203,13 @@ static void parse_args(int argc, char* argv[])
     };
 
     int c;
-    while ((c = z_getopt_long(argc, argv, "p:b:xXa:z:rnlh", lopts, NULL)) != -1) {
+    while ((c = z_getopt_long(argc, argv, "p:b:xXa:z:rdVsnvw:lh", lopts, NULL)) != -1) {
         switch (c) {
         case 'p':
-            free(opt.port);
-            opt.port = z_strdup(z_optarg);
+            add_port(z_optarg);
         break;
         case 'b':
+            opt.autobaud = (strcmp(z_optarg, "auto") == 0);
             opt.baud = strtoul(z_optarg, NULL, 10);
         break;
         case 'x':
@@ -113,11 +227,26 @@ static void parse_args(int argc, char* argv[])
         case 'r':
             opt.read = true;
         break;
+        case 'd':
+            opt.diff = true;
+        break;
+        case 'V':
+            opt.verify = true;
+        break;
+        case 's':
+            opt.stream = true;
+        break;
         case 'n':
             opt.noreset = true;
             if (opt.baud == 0)
                 opt.baud = 19200;
         break;
+        case 'v':
+            opt.verbose = true;
+        break;
+        case 'w':
+            opt.window = strtoul(z_optarg, NULL, 0);
+        break;
         case 0:
         case 1:
         case 2:
@@ -125,6 +254,18 @@ static void parse_args(int argc, char* argv[])
             opt.fuse_mask |= 1 << c;
             opt.fuse[c] = strtoul(z_optarg, NULL, 16);
         break;
+        case 4:
+            opt.wrap = strtoul(z_optarg, NULL, 0);
+        break;
+        case 5:
+            opt.trace = z_strdup(z_optarg);
+        break;
+        case 6:
+            opt.replay = z_strdup(z_optarg);
+        break;
+        case 7:
+            opt.low_latency = true;
+        break;
         case 'l':
             list_ports();
             exit(EXIT_SUCCESS);
@@ -140,6 +281,39 @@ static void parse_args(int argc, char* argv[])
 
     if (z_optind == argc - 1)
         opt.file = z_strdup(argv[z_optind]);
+    if (opt.stream && (opt.read || opt.diff || opt.verify)) {
+        z_warnx("--stream cannot be combined with --read, --diff or --verify");
+        usage(EXIT_FAILURE);
+    }
+    if (opt.nports > 1 && (opt.read || opt.stream)) {
+        z_warnx("multiple ports cannot be combined with --read or --stream");
+        usage(EXIT_FAILURE);
+    }
+    if ((opt.nports > 1 || opt.replay != NULL) && opt.trace != NULL) {
+        z_warnx("--trace cannot be combined with multiple ports or --replay");
+        usage(EXIT_FAILURE);
+    }
+}
+
+// append port name (or wildcard pattern) to the list
+void add_port(const char* port)
+{
+#if defined(__unix__)
+    if (strpbrk(port, "*?[") != NULL) {
+        glob_t g;
+        int err = glob(port, 0, NULL, &g);
+        if (err == GLOB_NOMATCH)
+            z_error(EXIT_FAILURE, ENOENT, "%s", port);
+        if (err != 0)
+            z_error(EXIT_FAILURE, errno, "glob(%s)", port);
+        for (size_t i = 0; i < g.gl_pathc; ++i)
+            add_port(g.gl_pathv[i]);
+        globfree(&g);
+        return;
+    }
+#endif
+    opt.ports = (char**)z_realloc(opt.ports, (opt.nports + 1) * sizeof(char*));
+    opt.ports[opt.nports++] = z_strdup(port);
 }
 
 int main(int argc, char* argv[])
@@ -147,67 +321,176 @@ int main(int argc, char* argv[])
     opt.base = SIZE_MAX;    // not used
     opt.size = SIZE_MAX;
     parse_args(argc, argv);
+    // undo --low-latency also after z_error() and Ctrl-C
+    if (opt.low_latency) {
+        atexit(restore_link);
+        signal(SIGINT, restore_on_signal);
+        signal(SIGTERM, restore_on_signal);
+    }
+    // keep stdout clean when dumping there
+    con = (opt.read && opt.file != NULL && strcmp(opt.file, "-") == 0) ? stderr : stdout;
+
+    // parse image once for all ports
+    IHX ihx;
+    ihx_init(&ihx);
+    if (opt.file != NULL && !opt.read && !opt.stream) {
+        FILE* f = z_fopen(opt.file, "rb");
+        if (ihx_load(&ihx, 0xff, f) < 0)
+            z_error(EXIT_FAILURE, errno, "ihx_load");
+        fclose(f);
+    }
 
-    // ISP connection
-    intptr_t isp = ucomm_open(opt.port, opt.baud, 0x801/*8-N-1*/);
-    if (isp < 0) {
-        if (opt.port != NULL)
-            z_error(EXIT_FAILURE, errno, "ucomm_open(%s)", opt.port);
+    int status = (opt.nports > 1 && opt.replay == NULL) ? gang(&ihx)
+        : program((opt.nports > 0) ? opt.ports[0] : NULL, &ihx);
+
+    ihx_free(&ihx);
+    for (size_t i = 0; i < opt.nports; ++i)
+        free(opt.ports[i]);
+    free(opt.ports);
+    free(opt.trace);
+    free(opt.replay);
+    exit(status);
+}
+
+// program device attached to port
+int program(const char* port, const IHX* image)
+{
+    // ISP connection (recorded session stands in for port)
+    intptr_t isp = (opt.replay != NULL) ? ucomm_replay(opt.replay)
+        : ucomm_open(port, opt.baud,
+            0x801/*8-N-1*/ | (opt.low_latency ? UCOMM_LOWLATENCY : 0));
+    if (isp == -1) {
+        if (opt.replay != NULL)
+            z_error(EXIT_FAILURE, errno, "ucomm_replay(%s)", opt.replay);
+        if (port != NULL)
+            z_error(EXIT_FAILURE, errno, "ucomm_open(%s)", port);
         z_warnx("missing port name");
         usage(EXIT_FAILURE);
     }
-    free(opt.port);
+    linked = isp;
+    if (opt.trace != NULL && ucomm_trace(isp, opt.trace) < 0)
+        z_error(EXIT_FAILURE, errno, "ucomm_trace(%s)", opt.trace);
+#if defined(UCOMM_ASYNC)
+    UCOMM_LATENCY lat;
+    if (opt.verbose && opt.low_latency && ucomm_latency(isp, &lat) == 0) {
+        fprintf(con, "ASYNC_LOW_LATENCY: %s\n", (lat.async_low_latency < 0) ? "n/a"
+            : lat.async_low_latency ? "yes" : "failed");
+        if (lat.latency_timer < 0)
+            fprintf(con, "Latency Timer: n/a\n");
+        else
+            fprintf(con, "Latency Timer: %d ms (was %d ms)\n", lat.latency_timer,
+                lat.old_latency_timer);
+    }
+#endif
+
+    // link errors make transfer() return early (see link_error)
+    for (;;) {
+        // Wait for connect
+        fprintf(con, "Wait for connection...\n");
+        // retry often so as not to miss bootloader entry window
+        ucomm_timeout(isp, SYNC_TIMEOUT);
+        ucomm_deadline(isp, SYNC_TIMEOUT);
+        if (opt.autobaud && opt.replay == NULL) {
+            link_rate = autobaud(isp, link_rate);
+        } else {
+            if (!opt.noreset)
+                target_reset(isp);
+            // recorded --baud=auto session synced AUTOBAUD_SYNCS times at the rate found
+            unsigned syncs = opt.autobaud ? AUTOBAUD_SYNCS : 1;
+            for (unsigned tries = 0, ok = 0; ok < syncs; ++tries) {
+                // STK_GET_SYNC (do not hang on a dead port in gang mode; replay ends
+                // with the recording)
+                ok = (isp_command('0', isp) == STK_OK) ? ok + 1 : 0;
+                replay_check(isp, "STK_GET_SYNC");
+                if (ok == 0 && opt.nports > 1 && tries >= GANG_SYNC_TRIES)
+                    z_error(EXIT_FAILURE, ETIMEDOUT, "no response");
+            }
+        }
+        ucomm_timeout(isp, UCOMM_DEFAULT_TIMEOUT);
+        ucomm_deadline(isp, 0);
+        ucomm_purge(isp);
 
-    if (!opt.noreset) {
-        // assert RTS then DTR (aka nodemcu reset)
-        ucomm_rts(isp, 1);
-        ucomm_dtr(isp, 1);
-        ucomm_rts(isp, 0);
-        ucomm_dtr(isp, 0);
+        // output file or input stream cannot be rewound, recording cannot be resent
+        relink_armed = opt.autobaud && !opt.read && !opt.stream && opt.replay == NULL
+            && link_rate + 1 < sizeof(rates) / sizeof(rates[0]);
+        if (transfer(image, isp) == 0)
+            break;
+        erased = false;
+        ++link_rate;
+        fprintf(con, "\n%s\nLink errors, starting over at lower baud rate\n", link_msg);
     }
 
-    // Wait for connect
-    puts("Wait for connection...");
-    do {
-        // STK_GET_SYNC
-    } while (isp_command('0', isp) != STK_OK);
-    ucomm_purge(isp);
+    relink_armed = false;
+    isp_0('Q', isp);
+#if defined(UCOMM_ASYNC)
+    UCOMM_STATS st;
+    if (opt.verbose && ucomm_stats(isp, &st) == 0)
+        fprintf(con, "Serial I/O: %zu reads (%zu served from buffer), %zu writes\n",
+            st.reads, st.saved, st.writes);
+#endif
+    if (opt.trace != NULL && ucomm_trace(isp, NULL) < 0)
+        z_error(EXIT_FAILURE, errno, "ucomm_trace(%s)", opt.trace);
+    linked = -1;
+    ucomm_close(isp);
+    return EXIT_SUCCESS;
+}
 
+// identify device, then erase, read/write and program fuses as requested
+// return 0 or -1 on link error (see link_error)
+int transfer(const IHX* image, intptr_t isp)
+{
     // test if anything is attached
     struct isp_device d;
-    if (isp_guess(&d, isp) == 0)
-        z_error(EXIT_FAILURE, ENODEV, "isp_guess");
+    int found = isp_guess(&d, isp);
+    if (found < 0)
+        return -1;
+    if (found == 0)
+        return link_error("isp_guess: %s", strerror(ENODEV));
 
     isp_set_device(at89s(d.sig) ? 0xe1 : 0x86, d.fsz, d.psz, isp);
-    isp_0('P', isp);
+    if (isp_0('P', isp) < 0)
+        return -1;
+    d.probes = PAGE_MODE_PROBES;
+    if (at89s(d.sig) && page_mode(&d, 0, isp) < 0)
+        return -1;
+
+    fprintf(con, "Device ID: %#x\n", d.sig);
+    fprintf(con, "Flash Memory: %zuKB,%zup,x%zu\n", d.fsz / 1024, d.fsz / d.psz, d.psz);
+    fprintf(con, "STK_UNIVERSAL: %s\n", d.cmdV ? "yes" : "no");
+    if (at89s(d.sig))
+        fprintf(con, "Page Mode: %s\n", d.paged ? "yes"
+            : (d.probes > 0) ? "no (tested again after first page write)" : "no");
+    fprintf(con, "Baud Rate: %u\n", ucomm_baud(isp));
 
-    printf("Device ID: %#x\n", d.sig);
-    printf("Flash Memory: %zuKB,%zup,x%zu\n", d.fsz / 1024, d.fsz / d.psz, d.psz);
-    printf("STK_UNIVERSAL: %s\n", d.cmdV ? "yes" : "no");
+    // AT89S has no page erase
+    if (opt.diff && at89s(d.sig))
+        z_error(EXIT_FAILURE, -1, "Diff mode not supported");
 
     // Show fuses
     if (d.cmdV) {
         if (at89s(d.sig)) {
-            uint8_t lock = isp_v(0x24, 0, 0, 0, isp);
-            printf("Lock=%x\n", lock);
+            int lock = isp_v(0x24, 0, 0, 0, isp);
+            if (lock < 0)
+                return -1;
+            fprintf(con, "Lock=%x\n", lock);
         } else {
-            uint8_t lfuse = isp_v(0x50, 0, 0, 0, isp);
-            uint8_t hfuse = isp_v(0x58, 8, 0, 0, isp);
-            uint8_t efuse = isp_v(0x50, 8, 0, 0, isp);
-            uint8_t lock = isp_v(0x58, 0, 0, 0, isp);
-            printf("Fuse=%x:%x:%x Lock=%x\n", lfuse, hfuse, efuse, lock);
+            static const uint8_t cmd[][4] = {
+                { 0x50, 0, 0, 0 },  // low fuse
+                { 0x58, 8, 0, 0 },  // high fuse
+                { 0x50, 8, 0, 0 },  // extended fuse
+                { 0x58, 0, 0, 0 },  // lock
+            };
+            uint8_t fuse[4];
+            if (isp_vn(cmd, fuse, 4, isp) < 0)
+                return -1;
+            fprintf(con, "Fuse=%x:%x:%x Lock=%x\n", fuse[0], fuse[1], fuse[2], fuse[3]);
         }
     }
 
     // Erase
-    if (opt.erase > 0 || (opt.erase == 0 && opt.file != NULL && !opt.read)) {
-        puts("Erase Chip");
-        if (d.cmdV)
-            isp_v(0xac, 0x80, 0, 0, isp);
-        else
-            isp_0('R', isp);
-        z_delay(500);       // delay >= 500 ms (AT89S)
-    }
+    if ((opt.erase > 0 || (opt.erase == 0 && opt.file != NULL && !opt.read && !opt.diff))
+        && erase_chip(&d, isp) < 0)
+        return -1;
 
     // Read/Write
     if (opt.file != NULL) {
@@ -219,169 +502,826 @@ int main(int argc, char* argv[])
             opt.size &= ~(d.psz - 1);
         }
 
-        FILE* f = z_fopen(opt.file, opt.read ? "w" : "rb");
-        IHX ihx;
+        int rc;
+        FILE* f = NULL;
         if (opt.read) {
             // Read Flash
-            ihx.base = ihx.entry = (opt.base < d.fsz) ? opt.base : 0;
-            ihx.sz = min(opt.size, d.fsz - ihx.base);
-            ihx.image = (uint8_t*)z_malloc(ihx.sz);
-            printf("Read Flash[%zu] ", ihx.sz);
-            for (size_t cnt = 0; cnt < ihx.sz; cnt += d.psz) {
-                if (at89s(d.sig)) {
-                    // reading AT89S in slow byte mode
-                    for (size_t i = 0; i < d.psz; ++i) {
-                        uint16_t addr = ihx.base + cnt + i;
-                        ihx.image[cnt + i] = isp_v(0x20, addr >> 8, addr, 0, isp);
-                    }
-                } else {
-                    // invoke STK_READ_PAGE
-                    isp_load_address(ihx.base + cnt, isp);
-                    if (isp_read_page(&ihx.image[cnt], d.psz, isp) != STK_OK)
-                        z_error(EXIT_FAILURE, -1, "READ_PAGE %#zx", ihx.base + cnt);
-                }
-                fputc('#', stdout);
-            }
-            ihx_dump(&ihx, 0xff, 0, f);
+            size_t base = (opt.base < d.fsz) ? opt.base : 0;
+            size_t sz = min(opt.size, d.fsz - base);
+            fprintf(con, "Read Flash[%zu] ", sz);
+            f = z_fopen(opt.file, "w");
+            read_file(&d, base, sz, f, isp);
+            rc = 0;
+        } else if (opt.stream) {
+            // Write Flash while parsing
+            f = z_fopen(opt.file, "rb");
+            rc = write_stream(&d, f, isp);
         } else {
             // Write Flash
-            if (ihx_load(&ihx, 0xff, f) < 0)
-                z_error(EXIT_FAILURE, errno, "ihx_load");
-            // overwrite image base and size
-            if (opt.base < d.fsz)
-                ihx.base = opt.base;
-            ihx.sz = min(ihx.sz, opt.size);
-            if (ihx.base + ihx.sz > d.fsz)
-                z_error(EXIT_FAILURE, EFBIG, "ihx_load");
-
-            printf("Write Flash[%zu] ", ihx.sz);
-            for (size_t cnt = 0; cnt < ihx.sz; cnt += d.psz) {
-                size_t rest = min(d.psz, ihx.sz - cnt);
-                if (at89s(d.sig)) {
-                    // writing AT89S in slow byte mode
-                    for (size_t i = 0; i < rest; ++i) {
-                        uint16_t addr = ihx.base + cnt + i;
-                        isp_v(0x40, addr >> 8, addr, ihx.image[cnt + i], isp);
-                    }
-                } else {
-                    // invoke STK_PROG_PAGE
-                    isp_load_address(ihx.base + cnt, isp);
-                    if (isp_prog_page(&ihx.image[cnt], rest, isp) != STK_OK)
-                        z_error(EXIT_FAILURE, -1, "PROG_PAGE %#zx", ihx.base + cnt);
-                }
-                fputc('#', stdout);
-            }
+            rc = write_image(&d, image, isp);
         }
-        fputc('\n', stdout);
-        free(ihx.image);
-        fclose(f);
+        if (f != NULL && fclose(f) == EOF && opt.read)
+            z_error(EXIT_FAILURE, errno, "%s", opt.file);
+        if (rc < 0)
+            return -1;
+        fputc('\n', con);
     }
 
     if (opt.fuse_mask != 0) {
         if (!d.cmdV || at89s(d.sig))
             z_error(EXIT_FAILURE, -1, "Fuse write not supported");
 
-        puts("Program Fuse");
-        // low fuse
-        if (opt.fuse_mask & 1)
-            isp_v(0xac, 0xa0, 0, opt.fuse[0], isp);
-        // high fuse
-        if (opt.fuse_mask & 2)
-            isp_v(0xac, 0xa8, 0, opt.fuse[1], isp);
-        // extended fuse
-        if (opt.fuse_mask & 4)
-            isp_v(0xac, 0xa4, 0, opt.fuse[2], isp);
-        // lock
-        if (opt.fuse_mask & 8)
-            isp_v(0xac, 0xe0, 0, opt.fuse[3], isp);
+        fprintf(con, "Program Fuse\n");
+        static const uint8_t cmd[][2] = {
+            { 0xac, 0xa0 },     // low fuse
+            { 0xac, 0xa8 },     // high fuse
+            { 0xac, 0xa4 },     // extended fuse
+            { 0xac, 0xe0 },     // lock
+        };
+        for (int i = 0; i < 4; ++i) {
+            if (opt.fuse_mask & (1 << i)) {
+                if (isp_v(cmd[i][0], cmd[i][1], 0, opt.fuse[i], isp) < 0
+                    || wait_ready(&d, FUSE_TIMEOUT, isp) < 0)
+                    return -1;
+            }
+        }
     }
 
-    isp_0('Q', isp);
-    ucomm_close(isp);
-    exit(EXIT_SUCCESS);
+    return 0;
+}
+
+// undo UCOMM_LOWLATENCY of the open port
+void restore_link(void)
+{
+#if defined(UCOMM_ASYNC)
+    if (linked != -1)
+        ucomm_restore(linked);
+#endif
+}
+
+void restore_on_signal(int sig)
+{
+    restore_link();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// program all ports at once
+// every port is driven by a child process, so z_error() only fails that port
+int gang(const IHX* image)
+{
+#if defined(__unix__)
+    struct {
+        pid_t pid;
+        int fd, status;
+        size_t len;
+        char line[1024];
+    }* w = z_malloc(opt.nports * sizeof(*w));
+    struct pollfd* pfd = (struct pollfd*)z_malloc(opt.nports * sizeof(struct pollfd));
+
+    fflush(NULL);
+    for (size_t i = 0; i < opt.nports; ++i) {
+        int p[2];
+        if (pipe(p) < 0)
+            z_error(EXIT_FAILURE, errno, "pipe");
+        w[i].pid = fork();
+        if (w[i].pid < 0)
+            z_error(EXIT_FAILURE, errno, "fork");
+        if (w[i].pid == 0) {
+            // child: both stdout and stderr go to parent
+            close(p[0]);
+            for (size_t j = 0; j < i; ++j)
+                close(w[j].fd);
+            dup2(p[1], STDOUT_FILENO);
+            dup2(p[1], STDERR_FILENO);
+            close(p[1]);
+            // stdout was used before fork, so line buffering needs a fresh stream
+            con = fdopen(dup(STDOUT_FILENO), "w");
+            if (con == NULL)
+                z_error(EXIT_FAILURE, errno, "fdopen");
+            setvbuf(con, NULL, _IOLBF, 0);
+            exit(program(opt.ports[i], image));
+        }
+        close(p[1]);
+        w[i].fd = p[0];
+        w[i].len = 0;
+    }
+
+    // print child output line by line, prefixed with its port
+    for (size_t nopen = opt.nports; nopen > 0; ) {
+        for (size_t i = 0; i < opt.nports; ++i) {
+            pfd[i].fd = w[i].fd;
+            pfd[i].events = POLLIN;
+        }
+        if (poll(pfd, opt.nports, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            z_error(EXIT_FAILURE, errno, "poll");
+        }
+        for (size_t i = 0; i < opt.nports; ++i) {
+            if (pfd[i].revents == 0)
+                continue;
+            ssize_t n = read(w[i].fd, &w[i].line[w[i].len], sizeof(w[i].line) - w[i].len);
+            if (n < 0 && errno == EINTR)
+                continue;   // poll again
+            if (n < 0)
+                z_warnx("%s: read: %s", opt.ports[i], strerror(errno));
+            if (n > 0)
+                w[i].len += n;
+            // complete lines (or full buffer, or end of output)
+            char* line = w[i].line;
+            size_t start = 0;
+            for (size_t j = 0; j < w[i].len; ++j) {
+                if (line[j] == '\n') {
+                    printf("%s: %.*s\n", opt.ports[i], (int)(j - start), &line[start]);
+                    start = j + 1;
+                }
+            }
+            bool full = (start == 0 && w[i].len == sizeof(w[i].line));
+            if (start < w[i].len && (n <= 0 || full)) {
+                printf("%s: %.*s\n", opt.ports[i], (int)(w[i].len - start), &line[start]);
+                start = w[i].len;
+            }
+            memmove(w[i].line, &w[i].line[start], w[i].len - start);
+            w[i].len -= start;
+            fflush(stdout);
+            if (n <= 0) {
+                close(w[i].fd);
+                w[i].fd = -1;   // ignored by poll()
+                --nopen;
+            }
+        }
+    }
+
+    // summary
+    int status = EXIT_SUCCESS;
+    printf("\n%-24s Result\n", "Port");
+    for (size_t i = 0; i < opt.nports; ++i) {
+        while (waitpid(w[i].pid, &w[i].status, 0) < 0 && errno == EINTR)
+            ;
+        if (WIFEXITED(w[i].status) && WEXITSTATUS(w[i].status) == EXIT_SUCCESS) {
+            printf("%-24s PASS\n", opt.ports[i]);
+        } else {
+            if (WIFSIGNALED(w[i].status))
+                printf("%-24s FAIL (signal %d)\n", opt.ports[i], WTERMSIG(w[i].status));
+            else
+                printf("%-24s FAIL\n", opt.ports[i]);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    free(pfd);
+    free(w);
+    return status;
+#else
+    (void)image;
+    z_error(EXIT_FAILURE, ENOSYS, "gang mode");
+    return EXIT_FAILURE;
+#endif
 }
 
-// test if AT89S or AVR chip
-bool at89s(uint32_t sig)
+// erase chip
+// return 0 or -1 on link error
+int erase_chip(const struct isp_device* d, intptr_t fd)
 {
-    return (sig & 0xf000) == 0x5000 || (sig & 0xf000) == 0x7000;
+    fprintf(con, "Erase Chip\n");
+    uint32_t start = z_msec();
+    if ((d->cmdV ? isp_v(0xac, 0x80, 0, 0, fd) : isp_0('R', fd)) < 0)
+        return -1;
+    if (!d->cmdV || at89s(d->sig))
+        z_delay(500);   // delay >= 500 ms (AT89S)
+    else if (wait_ready(d, ERASE_TIMEOUT, fd) < 0)
+        return -1;
+    if (opt.verbose)
+        fprintf(con, "Erase took %u ms\n", (unsigned)(z_msec() - start));
+    // bootloaders may fake STK_CHIP_ERASE
+    erased = d->cmdV;
+    return 0;
 }
 
-// Atmel Signature => Flash Size
-size_t atmel_flashsize(uint32_t sig)
+// AVR: poll RDY/BSY about every millisecond until ready
+// return 1 if ready, 0 on timeout or if polling is not supported, -1 on link error
+int wait_ready(const struct isp_device* d, uint32_t ms, intptr_t fd)
 {
-    unsigned nib2 = (sig >> 8) & 0xf;
-    return at89s(sig) ? (nib2 << 12) : (1024U << nib2);
+    if (!d->cmdV || at89s(d->sig))
+        return 0;
+    uint32_t start = z_msec();
+    do {
+        int busy = isp_v(0xf0, 0, 0, 0, fd);
+        if (busy < 0)
+            return -1;
+        if (!(busy & 1))
+            return 1;
+        // do not flood the programmer (fuse writes take ~5 ms, erase ~10 ms)
+        z_delay(1);
+    } while (z_msec() - start < ms);
+    z_warnx("device busy after %u ms", (unsigned)ms);
+    return 0;
 }
 
-// Atmel Flash Size => Page Size
-size_t atmel_pagesize(uint32_t sig, size_t fsz)
+// AT89S: test if programmer does page transfers for device code 0xe1
+// compares the start of the page at address and of a neighbour page read both ways
+// note: uniform flash (e.g., blank) cannot reveal wrong addressing, so byte mode is
+// kept and the test is repeated after a page is written (see prog_page)
+// return 0 or -1 on link error
+int page_mode(struct isp_device* d, size_t address, intptr_t fd)
 {
-    if ((sig & 0xf000) == 0x5000)
-        return 256;
-    if ((sig & 0xf000) == 0x7000)
-        return 64;
-    if (fsz <= 2048)
-        return 32;
-    if (fsz <= 8192)
-        return 64;
-    if (fsz <= 32768)
-        return 128;
-    return 256;
+    enum { N = 32 };    // bytes at the start of each page
+    size_t page[2];
+    page[0] = address & ~(d->psz - 1);
+    page[1] = (page[0] + d->psz < d->fsz) ? page[0] + d->psz : page[0] - d->psz;
+
+    uint8_t cmd[2 * N][4], ref[2 * N], buffer[2 * N];
+    for (size_t i = 0; i < 2 * N; ++i) {
+        uint16_t addr = page[i / N] + i % N;
+        cmd[i][0] = 0x20;
+        cmd[i][1] = addr >> 8;
+        cmd[i][2] = addr;
+        cmd[i][3] = 0;
+    }
+    d->paged = false;
+    if (isp_vn(cmd, ref, 2 * N, fd) < 0)
+        return -1;
+    if (memcmp(ref, ref + 1, 2 * N - 1) == 0) {
+        // undecided
+        if (d->probes > 0)
+            --d->probes;
+        return 0;
+    }
+    d->probes = 0;
+
+    int resp = STK_OK;
+    for (size_t i = 0; i < 2 && resp == STK_OK; ++i) {
+        resp = isp_load_address(page[i], fd);
+        if (resp == STK_OK)
+            resp = isp_read_page(&buffer[i * N], N, fd);
+    }
+    if (resp != STK_OK) {
+        // unknown command may be left unanswered, so resync
+        ucomm_purge(fd);
+        if (isp_command('0', fd) != STK_OK)
+            return link_error("STK_GET_SYNC");
+        return 0;
+    }
+    d->paged = (memcmp(buffer, ref, 2 * N) == 0);
+    return 0;
+}
+
+// read flash memory
+// if mask != NULL then read only pages with non-zero mask[]
+// return 0 or -1 on link error
+int read_flash(const struct isp_device* d, size_t address, uint8_t* buffer,
+    size_t length, const uint8_t* mask, intptr_t fd)
+{
+    ISP_PIPE pp;
+    isp_pipe_init(&pp, opt.window, fd);
+    for (size_t cnt = 0; cnt < length; cnt += d->psz) {
+        size_t rest = min(d->psz, length - cnt);
+        if (mask != NULL && !mask[cnt / d->psz]) {
+            fputc('.', con);
+            continue;
+        }
+        if (!d->paged) {
+            // reading AT89S in byte mode (batched)
+            uint8_t cmd[256][4];
+            for (size_t i = 0; i < rest; ++i) {
+                uint16_t addr = address + cnt + i;
+                cmd[i][0] = 0x20;
+                cmd[i][1] = addr >> 8;
+                cmd[i][2] = addr;
+                cmd[i][3] = 0;
+            }
+            if (isp_vn(cmd, &buffer[cnt], rest, fd) < 0)
+                return -1;
+        } else {
+            // invoke STK_READ_PAGE
+            if (isp_pipe_read_page(&pp, address + cnt, &buffer[cnt], rest) != STK_OK)
+                return link_error("READ_PAGE %#x", pp.address);
+        }
+        fputc('#', con);
+    }
+    if (isp_pipe_flush(&pp) != STK_OK)
+        return link_error("READ_PAGE %#x", pp.address);
+    return 0;
+}
+
+// formatter thread
+static void format_chunks(void* arg)
+{
+    struct reader* pr = (struct reader*)arg;
+    for (size_t k = 0; ; k = (k + 1) % 4) {
+        z_sem_wait(pr->full);
+        if (pr->chunk[k].length == 0)
+            break;
+        ihx_write(pr->pw, pr->chunk[k].address, pr->chunk[k].data, pr->chunk[k].length);
+        z_sem_post(pr->free);
+    }
+}
+
+// read flash memory to Intel HEX file
+// pages are formatted by a separate thread while the next ones are read
+void read_file(const struct isp_device* d, size_t address, size_t length,
+    FILE* f, intptr_t fd)
+{
+    struct reader rd;
+    size_t csz = ISP_WINDOW_MAX * d->psz;
+    rd.pw = ihx_writer(f, -1, 0xff, opt.wrap, address + length);
+    rd.full = z_sem_create(0);
+    rd.free = z_sem_create(4);
+    for (size_t k = 0; k < 4; ++k)
+        rd.chunk[k].data = z_malloc(csz);
+    intptr_t thread = z_thread_create(format_chunks, &rd);
+
+    size_t cnt = 0;
+    for (size_t k = 0; ; k = (k + 1) % 4) {
+        z_sem_wait(rd.free);
+        // empty chunk stops formatter
+        size_t rest = min(csz, length - cnt);
+        rd.chunk[k].address = address + cnt;
+        rd.chunk[k].length = rest;
+        // link errors are fatal here (--read is not retried)
+        if (rest > 0)
+            read_flash(d, address + cnt, rd.chunk[k].data, rest, NULL, fd);
+        z_sem_post(rd.full);
+        if (rest == 0)
+            break;
+        cnt += rest;
+    }
+
+    z_thread_join(thread);
+    if (ihx_writer_close(rd.pw, address) < 0)
+        z_error(EXIT_FAILURE, errno, "%s", opt.file);
+    for (size_t k = 0; k < 4; ++k)
+        free(rd.chunk[k].data);
+    z_sem_destroy(rd.free);
+    z_sem_destroy(rd.full);
+}
+
+// find index of the first differing byte (or length)
+size_t mismatch(const uint8_t* buf1, const uint8_t* buf2, size_t length)
+{
+    // memcmp() is vectorized by libc, so use it to skip equal blocks
+    size_t i = 0;
+    for (size_t block = 4096; i < length; i += block) {
+        block = min(block, length - i);
+        if (memcmp(&buf1[i], &buf2[i], block) != 0)
+            break;
+    }
+    for (; i < length; ++i)
+        if (buf1[i] != buf2[i])
+            break;
+    return i;
+}
+
+// test if buffer is all 0xff
+bool blank(const uint8_t* buffer, size_t length)
+{
+    return length == 0 || (buffer[0] == 0xff
+        && memcmp(buffer, buffer + 1, length - 1) == 0);
+}
+
+// write image (compare and verify as requested)
+// return 0 or -1 on link error
+int write_image(struct isp_device* d, const IHX* image, intptr_t fd)
+{
+    IHX ihx = *image;
+    // overwrite image base and size
+    if (opt.base < d->fsz) {
+        IHX_SEGMENT* seg = (IHX_SEGMENT*)z_malloc(ihx.nseg * sizeof(IHX_SEGMENT));
+        for (size_t i = 0; i < ihx.nseg; ++i) {
+            seg[i] = ihx.seg[i];
+            seg[i].address += opt.base - ihx.base;
+        }
+        ihx.seg = seg;
+        ihx.base = opt.base;
+    }
+    ihx.sz = min(ihx.sz, opt.size);
+    if (ihx.base + ihx.sz > d->fsz)
+        z_error(EXIT_FAILURE, EFBIG, "ihx_load");
+
+    // pages are assembled from segments; keep those still in flight
+    uint8_t* pages = (uint8_t*)z_malloc(ISP_WINDOW_MAX * d->psz);
+    size_t npages = (ihx.sz + d->psz - 1) / d->psz;
+    uint8_t* dirty = (uint8_t*)memset(z_malloc(npages), 1, npages);
+    int rc = write_pages(d, &ihx, pages, dirty, fd);
+
+    free(dirty);
+    free(pages);
+    if (ihx.seg != image->seg)
+        free(ihx.seg);
+    return rc;
+}
+
+// write pages marked dirty[]
+// return 0 or -1 on link error
+int write_pages(struct isp_device* d, const IHX* ihx, uint8_t* pages,
+    uint8_t* dirty, intptr_t fd)
+{
+    size_t npages = (ihx->sz + d->psz - 1) / d->psz;
+    uint8_t* page = pages;
+
+    // compare pages with device
+    if (opt.diff && !erased) {
+        uint8_t* flash = (uint8_t*)z_malloc(ihx->sz);
+        fprintf(con, "Compare Flash[%zu] ", ihx->sz);
+        int rc = read_flash(d, ihx->base, flash, ihx->sz, NULL, fd);
+        size_t ndirty = 0;
+        for (size_t i = 0, cnt = 0; rc == 0 && i < npages; ++i, cnt += d->psz) {
+            size_t rest = min(d->psz, ihx->sz - cnt);
+            ihx_read(ihx, ihx->base + cnt, page, rest, 0xff);
+            dirty[i] = (memcmp(&flash[cnt], page, rest) != 0);
+            ndirty += dirty[i];
+        }
+        free(flash);
+        if (rc < 0)
+            return -1;
+        fputc('\n', con);
+        // ISP page write does not erase, so start over
+        if (ndirty > 0 && d->cmdV) {
+            if (erase_chip(d, fd) < 0)
+                return -1;
+            memset(dirty, 1, npages);
+        }
+    }
+
+    ISP_PIPE pp;
+    isp_pipe_init(&pp, opt.window, fd);
+    size_t nskip = 0, nblank = 0, nsent = 0;
+    fprintf(con, "Write Flash[%zu] ", ihx->sz);
+    for (size_t cnt = 0; cnt < ihx->sz; cnt += d->psz) {
+        size_t rest = min(d->psz, ihx->sz - cnt);
+        if (!dirty[cnt / d->psz]) {
+            // page is up to date
+            ++nskip;
+            fputc('.', con);
+            continue;
+        }
+        page = &pages[(nsent % ISP_WINDOW_MAX) * d->psz];
+        ihx_read(ihx, ihx->base + cnt, page, rest, 0xff);
+        if (erased && blank(page, rest)) {
+            // page is erased already
+            dirty[cnt / d->psz] = 0;
+            ++nblank;
+            fputc('.', con);
+            continue;
+        }
+        ++nsent;
+        if (prog_page(d, ihx->base + cnt, page, rest, &pp) < 0)
+            return -1;
+        fputc('#', con);
+    }
+    if (isp_pipe_flush(&pp) != STK_OK)
+        return link_error("PROG_PAGE %#x", pp.address);
+    if (nskip > 0)
+        fprintf(con, "\nSkipped %zu unchanged pages", nskip);
+    if (nblank > 0)
+        fprintf(con, "\nSkipped %zu blank pages", nblank);
+
+    // Verify Flash
+    if (opt.verify && nsent > 0) {
+        uint8_t* flash = (uint8_t*)z_malloc(ihx->sz);
+        fprintf(con, "\nVerify Flash[%zu] ", ihx->sz);
+        int rc = read_flash(d, ihx->base, flash, ihx->sz, dirty, fd);
+        for (size_t cnt = 0; rc == 0 && cnt < ihx->sz; cnt += d->psz) {
+            if (!dirty[cnt / d->psz])
+                continue;
+            size_t rest = min(d->psz, ihx->sz - cnt);
+            ihx_read(ihx, ihx->base + cnt, pages, rest, 0xff);
+            size_t i = mismatch(&flash[cnt], pages, rest);
+            if (i < rest)
+                z_error(EXIT_FAILURE, -1, "VERIFY %#zx: %#x != %#x",
+                    ihx->base + cnt + i, flash[cnt + i], pages[i]);
+        }
+        free(flash);
+        if (rc < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// write one page
+// note: page must stay intact while in flight
+// return 0 or -1 on link error
+int prog_page(struct isp_device* d, size_t address, const uint8_t* page,
+    size_t length, ISP_PIPE* pp)
+{
+    if (!d->paged) {
+        // writing AT89S in byte mode (batched)
+        uint8_t cmd[256][4], b_out[256];
+        for (size_t i = 0; i < length; ++i) {
+            uint16_t addr = address + i;
+            cmd[i][0] = 0x40;
+            cmd[i][1] = addr >> 8;
+            cmd[i][2] = addr;
+            cmd[i][3] = page[i];
+        }
+        if (isp_vn(cmd, b_out, length, pp->fd) < 0)
+            return -1;
+        // page mode could not be told on blank flash, now there is data
+        return (d->probes > 0) ? page_mode(d, address, pp->fd) : 0;
+    }
+    // invoke STK_PROG_PAGE
+    if (isp_pipe_prog_page(pp, address, page, length) != STK_OK)
+        return link_error("PROG_PAGE %#x", pp->address);
+    return 0;
+}
+
+// send assembled page
+// return 0 or -1 on link error
+static int flush_slot(struct assembler* pa, size_t k)
+{
+    struct isp_device* d = pa->d;
+    uint8_t* page = &pa->pages[(pa->nsent % ISP_WINDOW_MAX) * d->psz];
+    size_t address = pa->slot[k].address;
+    memcpy(page, pa->slot[k].data, d->psz);
+    pa->slot[k].used = false;
+
+    if (erased && !pa->written[address / d->psz] && blank(page, d->psz)) {
+        // page is erased already
+        ++pa->nblank;
+        fputc('.', con);
+    } else {
+        ++pa->nsent;
+        pa->written[address / d->psz] = 1;
+        if (prog_page(d, address, page, d->psz, &pa->pp) < 0)
+            return -1;
+        fputc('#', con);
+    }
+    return 0;
+}
+
+// IHX_CALLBACK: put data into pages
+static int assemble(void* arg, size_t address, const uint8_t* data, size_t length)
+{
+    struct assembler* pa = (struct assembler*)arg;
+    const struct isp_device* d = pa->d;
+
+    if (!pa->started) {
+        // first record sets image base
+        pa->started = true;
+        pa->first = address;
+        if (opt.base < d->fsz)
+            pa->shift = opt.base - address;
+        address += pa->shift;
+        pa->limit = (opt.size < d->fsz) ? address + opt.size : SIZE_MAX;
+    } else if (address < pa->first && (opt.base < d->fsz || opt.size < d->fsz)) {
+        // lower base is known only after the whole file (see ihx_load)
+        pa->error = "record below first address (--base and --size need ascending"
+            " records)";
+        return 1;
+    } else
+        address += pa->shift;
+
+    if (address >= pa->limit)
+        return 0;
+    length = min(length, pa->limit - address);
+    if (address + length > d->fsz)
+        z_error(EXIT_FAILURE, EFBIG, "ihx_stream");
+
+    while (length > 0) {
+        size_t page = address & ~(d->psz - 1);
+        size_t n = min(length, page + d->psz - address);
+
+        // find page or free slot; pages behind are complete
+        size_t k = SIZE_MAX, lowest = SIZE_MAX;
+        for (size_t i = 0; i < sizeof(pa->slot) / sizeof(pa->slot[0]); ++i) {
+            if (pa->slot[i].used && pa->slot[i].address < page
+                && flush_slot(pa, i) < 0) {
+                pa->error = link_msg;
+                return 1;
+            }
+            if (pa->slot[i].used) {
+                if (pa->slot[i].address == page)
+                    k = i;
+                else if (lowest == SIZE_MAX
+                    || pa->slot[i].address < pa->slot[lowest].address)
+                    lowest = i;
+            } else if (k == SIZE_MAX)
+                k = i;
+        }
+        if (k == SIZE_MAX) {
+            // out of order; send the lowest page
+            if (flush_slot(pa, lowest) < 0) {
+                pa->error = link_msg;
+                return 1;
+            }
+            k = lowest;
+        }
+
+        if (!pa->slot[k].used) {
+            pa->slot[k].used = true;
+            pa->slot[k].address = page;
+            if (pa->written[page / d->psz]) {
+                // page was sent already, merge with device contents
+                int rc = (isp_pipe_flush(&pa->pp) == STK_OK) ? 0
+                    : link_error("PROG_PAGE %#x", pa->pp.address);
+                if (rc == 0)
+                    rc = read_flash(d, page, pa->slot[k].data, d->psz, NULL, pa->fd);
+                if (rc < 0) {
+                    pa->error = link_msg;
+                    return 1;
+                }
+                ++pa->nrewrite;
+            } else
+                memset(pa->slot[k].data, 0xff, d->psz);
+        }
+
+        memcpy(&pa->slot[k].data[address - page], data, n);
+        address += n;
+        data += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+// write flash while parsing file
+// return 0 or -1 on link error
+int write_stream(struct isp_device* d, FILE* f, intptr_t fd)
+{
+    struct assembler as = {
+        .d = d,
+        .fd = fd,
+        .pages = (uint8_t*)z_malloc(ISP_WINDOW_MAX * d->psz),
+        .written = (uint8_t*)memset(z_malloc(d->fsz / d->psz), 0, d->fsz / d->psz),
+    };
+    const size_t nslots = sizeof(as.slot) / sizeof(as.slot[0]);
+    for (size_t i = 0; i < nslots; ++i)
+        as.slot[i].data = (uint8_t*)z_malloc(d->psz);
+    isp_pipe_init(&as.pp, opt.window, fd);
+
+    fprintf(con, "Write Flash ");
+    IHX_STREAM st;
+    int rc = 0;
+    if (ihx_stream(&st, f, assemble, &as) < 0) {
+        if (as.error != link_msg)
+            z_error(EXIT_FAILURE, -1, "%s:%zu: %s", opt.file, st.line,
+                (as.error != NULL) ? as.error : st.error);
+        rc = -1;
+    }
+
+    // send the rest in order
+    while (rc == 0) {
+        size_t k = SIZE_MAX;
+        for (size_t i = 0; i < nslots; ++i)
+            if (as.slot[i].used && (k == SIZE_MAX
+                || as.slot[i].address < as.slot[k].address))
+                k = i;
+        if (k == SIZE_MAX)
+            break;
+        rc = flush_slot(&as, k);
+    }
+    if (rc == 0 && isp_pipe_flush(&as.pp) != STK_OK)
+        rc = link_error("PROG_PAGE %#x", as.pp.address);
+
+    if (rc == 0) {
+        fprintf(con, "\nWritten %zu pages", as.nsent);
+        if (as.nblank > 0)
+            fprintf(con, "\nSkipped %zu blank pages", as.nblank);
+        if (as.nrewrite > 0)
+            fprintf(con, "\nRewritten %zu pages out of order", as.nrewrite);
+    }
+
+    for (size_t i = 0; i < nslots; ++i)
+        free(as.slot[i].data);
+    free(as.written);
+    free(as.pages);
+    return rc;
 }
 
 // AVRISP: simple command
-void isp_0(int ch, intptr_t fd)
+// return 0 or -1 on link error
+int isp_0(int ch, intptr_t fd)
 {
     int resp = isp_command(ch, fd);
     if (resp != STK_OK)
-        z_error(EXIT_FAILURE, -1, "For '%c' got response %d", ch, resp);
+        return link_error("For '%c' got response %d", ch, resp);
+    return 0;
 }
 
 // AVRISP: universal command
-uint8_t isp_v(int b1, int b2, int b3, int b4, intptr_t fd)
+// return output byte or -1 on link error
+int isp_v(int b1, int b2, int b3, int b4, intptr_t fd)
 {
     uint8_t b_out;
     int resp = isp_universal(b1, b2, b3, b4, &b_out, fd);
     if (resp != STK_OK)
-        z_error(EXIT_FAILURE, -1, "For 'V %#x %#x %#x %#x' got response %d",
+        return link_error("For 'V %#x %#x %#x %#x' got response %d",
             b1, b2, b3, b4, resp);
     return b_out;
 }
 
+// AVRISP: universal command batch
+// return 0 or -1 on link error
+int isp_vn(const void* cmd, uint8_t* b_out, size_t n, intptr_t fd)
+{
+    int resp = isp_universal_n(cmd, b_out, n, fd);
+    if (resp != STK_OK) {
+        const uint8_t* b = (const uint8_t*)cmd;
+        return link_error("For 'V %#x %#x %#x %#x' (x%zu) got response %d",
+            b[0], b[1], b[2], b[3], n, resp);
+    }
+    return 0;
+}
+
 // AVRISP: guess device parameters
-uint32_t isp_guess(struct isp_device* d, intptr_t fd)
+// return 1 if device found, 0 if not, -1 on link error
+int isp_guess(struct isp_device* d, intptr_t fd)
 {
     d->sig = 0;
     isp_set_device(0x86, 32768, 128, fd);       // fake ATmega328P
 
-    isp_0('P', fd);
+    if (isp_0('P', fd) < 0)
+        return -1;
     if (isp_read_sign(&d->sig, fd) == STK_OK) {
         // AVR chip found
-        d->cmdV = (isp_v(0x30, 0, 0, 0, fd) == 0x1e);
+        int b = isp_v(0x30, 0, 0, 0, fd);
+        if (b < 0)
+            return -1;
+        d->cmdV = (b == 0x1e);
     } else {
         // test for AT89S
-        isp_0('Q', fd);
+        if (isp_0('Q', fd) < 0)
+            return -1;
         isp_set_device(0xe1, 8192, 256, fd);    // fake AT89S52
-        isp_0('P', fd);
-        d->cmdV = (isp_v(0x28, 0, 0, 0, fd) == 0x1e);
+        if (isp_0('P', fd) < 0)
+            return -1;
+        int b = isp_v(0x28, 0, 0, 0, fd);
+        if (b < 0)
+            return -1;
+        d->cmdV = (b == 0x1e);
         if (d->cmdV) {
             // read signature for AT89S directly
             // (e.g., "Arduino as ISP" can do STK_READ_SIGN for AVR only)
-            uint8_t sig1 = isp_v(0x28, 1, 0, 0, fd);
-            uint8_t sig2 = isp_v(0x28, 2, 0, 0, fd);
+            int sig1 = isp_v(0x28, 1, 0, 0, fd);
+            int sig2 = isp_v(0x28, 2, 0, 0, fd);
+            if (sig1 < 0 || sig2 < 0)
+                return -1;
             d->sig = (0x1e << 16) | (sig1 << 8) | sig2;
         }
     }
 
     // don't leave from bootloader's progmode (or it'd go reboot)
-    if (opt.noreset)
-        isp_0('Q', fd);
+    if (opt.noreset && isp_0('Q', fd) < 0)
+        return -1;
     if ((d->sig >> 16) != 0x1e)
         return 0;
     d->fsz = atmel_flashsize(d->sig);
     d->psz = atmel_pagesize(d->sig, d->fsz);
-    return d->sig;
+    d->paged = !at89s(d->sig);
+    return 1;
+}
+
+// assert RTS then DTR (aka nodemcu reset)
+void target_reset(intptr_t fd)
+{
+    ucomm_rts(fd, 1);
+    ucomm_dtr(fd, 1);
+    ucomm_rts(fd, 0);
+    ucomm_dtr(fd, 0);
+}
+
+// find the fastest baud rate that syncs reliably
+// note: a wrong rate may kick bootloader out, so reset target every time
+size_t autobaud(intptr_t fd, size_t first)
+{
+    for (size_t i = first; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+        ucomm_reset(fd, rates[i], 0x801);
+        if (!opt.noreset)
+            target_reset(fd);
+        unsigned ok = 0;
+        for (unsigned tries = 0; tries < AUTOBAUD_TRIES && ok < AUTOBAUD_SYNCS; ++tries)
+            ok = (isp_command('0', fd) == STK_OK) ? ok + 1 : 0;
+        if (ok == AUTOBAUD_SYNCS)
+            return i;
+        if (opt.verbose)
+            fprintf(con, "No sync at %u bps\n", rates[i]);
+    }
+    z_error(EXIT_FAILURE, ETIMEDOUT, "no baud rate found");
+    return 0;
+}
+
+// link error: fatal, unless --baud=auto can start over at lower rate
+// return -1 (message is kept in link_msg)
+int link_error(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(link_msg, sizeof(link_msg), fmt, args);
+    va_end(args);
+    replay_check(linked, link_msg);
+    if (!relink_armed)
+        z_error(EXIT_FAILURE, -1, "%s", link_msg);
+    return -1;
+}
+
+// replay: output differs from recording, so what follows cannot be played back
+void replay_check(intptr_t fd, const char* what)
+{
+    ssize_t offset = ucomm_diverged(fd);
+    if (offset >= 0)
+        z_error(EXIT_FAILURE, EPROTO, "%s: %s diverged at offset %zd", opt.replay,
+            what, offset);
 }
 
 void list_ports(void)
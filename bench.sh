@@ -0,0 +1,172 @@
+#!/bin/sh
+#
+# bench.sh
+#
+# End-to-end avrtool throughput against avrsim behind avrproxy
+# Usage: bench.sh [--csv|--json] [-o FILE]
+#
+# Sweep is set by environment (space separated lists):
+#   BAUDS     line rates (default "57600 115200 1000000")
+#   PAGES     page sizes (default "32 64 128 256")
+#   SIZES     image sizes (default "2048 8192"), skipped if too big for flash
+# Erase and fuse run with the first size only, their per KB figures are per run.
+#   OPS       paths to run (default "write read erase fuse")
+#   LATENCY   per transfer delay, ms (default 1)
+#   WINDOW    avrtool --window (default 1)
+#   BUSY      1 to run avrsim --busy-write, losing input during page writes
+#             (default 0)
+#
+# commands counts STK500 frames answered by avrsim; reply_transfers counts the
+# chunks avrproxy relayed back to avrtool (one reply may take several)
+#
+
+set -u
+cd "$(dirname "$0")"
+
+BAUDS=${BAUDS:-"57600 115200 1000000"}
+PAGES=${PAGES:-"32 64 128 256"}
+SIZES=${SIZES:-"2048 8192"}
+OPS=${OPS:-"write read erase fuse"}
+LATENCY=${LATENCY:-1}
+WINDOW=${WINDOW:-1}
+BUSY=${BUSY:-0}
+
+format=csv
+out=-
+while [ $# -gt 0 ]; do
+    case $1 in
+    --csv) format=csv ;;
+    --json) format=json ;;
+    -o) out=$2; shift ;;
+    *) echo "Usage: $0 [--csv|--json] [-o FILE]" >&2; exit 1 ;;
+    esac
+    shift
+done
+
+for tool in avrtool avrsim avrproxy; do
+    [ -x ./$tool ] || { echo "$0: ./$tool not built" >&2; exit 1; }
+done
+
+tmp=$(mktemp -d) || exit 1
+trap 'kill $sim $proxy 2>/dev/null; rm -rf "$tmp"' EXIT
+sim= proxy=
+
+# start process printing pty name on first line, wait for it
+# usage: spawn OUTFILE COMMAND...
+# sets pid and pty
+spawn() {
+    f=$1; shift
+    rm -f "$f"
+    "$@" > "$f" 2> "$f.err" &
+    pid=$!
+    while [ ! -s "$f" ]; do
+        kill -0 $pid 2>/dev/null || { cat "$f.err" >&2; exit 1; }
+        sleep 0.05
+    done
+    pty=$(head -n 1 "$f")
+}
+
+now_ns() {
+    date +%s%N
+}
+
+# run one case and print CSV row
+# usage: run OP BAUD PAGE SIZE
+run() {
+    op=$1 baud=$2 page=$3 size=$4
+    # avrtool takes page size from signature
+    case $page in
+    32) sig=1e9108 fsz=2048 ;;      # ATtiny25
+    64) sig=1e9307 fsz=8192 ;;      # ATmega8
+    128) sig=1e950f fsz=32768 ;;    # ATmega328P
+    256) sig=1e9801 fsz=262144 ;;   # ATmega2560
+    *) echo "$0: page size $page not supported" >&2; return ;;
+    esac
+    [ $size -le $fsz ] || return
+    # image size does not matter
+    case $op in
+    erase|fuse) [ $size = "${SIZES%% *}" ] || return ;;
+    esac
+    case $op in
+    write|read) mode=optiboot ;;
+    *) mode=arduinoisp ;;
+    esac
+    set --
+    [ $BUSY = 1 ] && set -- -B
+
+    head -c $size /dev/urandom > "$tmp/image.bin"
+    cp "$tmp/image.bin" "$tmp/flash.bin"
+    spawn "$tmp/sim" ./avrsim -v -m $mode -S $sig -i "$tmp/flash.bin" "$@"
+    sim=$pid
+    spawn "$tmp/proxy" ./avrproxy -v -b $baud -l $LATENCY -L $LATENCY $pty
+    proxy=$pid
+
+    set -- -p $pty -b $baud -w $WINDOW
+    bytes=$size
+    case $op in
+    write) set -- "$@" -X "$tmp/image.bin" ;;
+    read) set -- "$@" -r -a 0 -z $size "$tmp/out.hex" ;;
+    erase) set -- "$@" -n -x; bytes=0 ;;
+    fuse) set -- "$@" -n --lfuse=ff --hfuse=de --efuse=fd; bytes=0 ;;
+    esac
+
+    t0=$(now_ns)
+    ./avrtool "$@" > "$tmp/log" 2>&1
+    status=$?
+    t1=$(now_ns)
+
+    kill $proxy $sim
+    wait $proxy $sim 2>/dev/null
+    sim= proxy=
+    if [ $status -ne 0 ]; then
+        echo "$0: $op $baud $page $size: avrtool failed" >&2
+        cat "$tmp/log" >&2
+        return
+    fi
+
+    commands=$(sed -n 's/.* \([0-9]*\) commands,.*/\1/p' "$tmp/sim.err" | tail -n 1)
+    replies=$(sed -n 's/.*replies: .* \([0-9]*\) transfers,.*/\1/p' "$tmp/proxy.err")
+    awk -v op=$op -v baud=$baud -v page=$page -v size=$size -v window=$WINDOW \
+        -v latency=$LATENCY -v ns=$((t1 - t0)) -v bytes=$bytes \
+        -v commands=${commands:-0} -v replies=${replies:-0} 'BEGIN {
+        sec = ns / 1e9
+        bps = bytes / sec
+        kb = (bytes > 0) ? bytes / 1024 : 1
+        printf "%s,%d,%d,%d,%d,%s,%.3f,%.0f,%.1f,%d,%d,%.1f,%.1f\n",
+            op, baud, page, size, window, latency, sec, bps,
+            100 * bps / (baud / 10), commands, replies, commands / kb, replies / kb
+    }'
+}
+
+header="op,baud,page,size,window,latency_ms,seconds,bytes_per_s,line_pct,commands"
+header="$header,reply_transfers,commands_per_kb,reply_transfers_per_kb"
+{
+    echo "$header"
+    for op in $OPS; do
+        for baud in $BAUDS; do
+            for page in $PAGES; do
+                for size in $SIZES; do
+                    run $op $baud $page $size
+                done
+            done
+        done
+    done
+} > "$tmp/result.csv"
+
+if [ $format = json ]; then
+    awk -F, 'NR == 1 { split($0, key); next }
+    {
+        printf "%s{", (NR == 2) ? "[\n  " : ",\n  "
+        for (i = 1; i <= NF; ++i)
+            printf (i == 1) ? "\"%s\": \"%s\"" : ", \"%s\": %s", key[i], $i
+        printf "}"
+    }
+    END { print (NR > 1) ? "\n]" : "[]" }' "$tmp/result.csv" > "$tmp/result"
+else
+    mv "$tmp/result.csv" "$tmp/result"
+fi
+if [ "$out" = - ]; then
+    cat "$tmp/result"
+else
+    cp "$tmp/result" "$out"
+fi
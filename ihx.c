@@ -1,5 +1,17 @@
+#if defined(__unix__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include "ihx.h"
 #include "stdz.h"
+#if defined(_WIN32)
+#include <io.h>
+#define read _read
+#define write _write
+#elif defined(__unix__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define MIN_BYTES   5
 #define MAX_BYTES   (MIN_BYTES + 255)
@@ -11,49 +23,65 @@ typedef struct {
     unsigned count;
     size_t address;
     int type;
-    uint8_t data[255];
+    const char* error;  // reason if not parsed
+    uint8_t data[255];  // unless DATA stored in image
 } CHUNK;
 
-static int char2hex(int c)
-{
-    if (c < '0')
-        return -1;
-    if (c <= '9')
-        return c - '0';
-    if (c < 'A')
-        return -1;
-    if (c <= 'F')
-        return c - 'A' + 10;
-    if (c < 'a')
-        return -1;
-    if (c <= 'f')
-        return c - 'a' + 10;
-    return -1;
-}
+// hex digit value (0x10 if not a digit)
+#define X 0x10
+static const uint8_t hexdigit[256] = {
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
 
 static unsigned make16(unsigned high, unsigned low)
 {
     return (high << 8) + low;
 }
 
-static unsigned sum8(unsigned word)
+// convert hex pairs to bytes
+// return sum of bytes or -1 if not a hex string
+static int decode(uint8_t* dst, const char* src, size_t n)
 {
-    return (word >> 8) + word;
+    unsigned sum = 0, bad = 0;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned high = hexdigit[(uint8_t)src[2 * i]];
+        unsigned low = hexdigit[(uint8_t)src[2 * i + 1]];
+        bad |= high | low;
+        dst[i] = (uint8_t)((high << 4) | low);
+        sum += dst[i];
+    }
+    return (bad & 0x10) ? -1 : (int)(sum & 0xff);
 }
 
-// parse one record
+// parse one record of given length (w/o newline)
+// if ihx != NULL then DATA bytes are decoded straight into image at segment + address
 // return record type or -1
-static int parse_record(CHUNK* pc, const char* line)
+static int parse_record(CHUNK* pc, const char* line, size_t length, IHX* ihx,
+    size_t segment)
 {
     // init chunk
     pc->count = 0;
     pc->address = 0;
     pc->type = -1;
+    pc->error = NULL;
 
-    // cut newline character
-    unsigned length = strlen(line);
-    if (length > 0 && line[length - 1] == '\n')
-        --length;
+    // cut CR character
     if (length > 0 && line[length - 1] == '\r')
         --length;
 
@@ -61,73 +89,247 @@ static int parse_record(CHUNK* pc, const char* line)
     if (length == 0 || line[0] == ';')
         return 0;   // empty DATA
     // every line must start with colon
+    pc->error = "missing colon";
     if (line[0] != ':')
         return -1;
 
     // check number of characters
+    pc->error = "bad record length";
     if (length < MIN_LINE || length > MAX_LINE || !(length & 1))
         return -1;
 
-    // convert line to byte array
-    uint8_t blob[MAX_BYTES];
-    size_t bloblen = 0;
-    for (size_t i = 1; bloblen < MAX_BYTES; i += 2) {
-        int high = char2hex(line[i]);
-        if (high < 0)
-            break;
-        int low = char2hex(line[i + 1]);
-        if (low < 0)
-            break;
-        blob[bloblen++] = (high << 4) | low;
-    }
-    if (bloblen != (length - 1) / 2)
-        return -1;
-
     // get count, address and type
-    unsigned count = blob[0];
-    unsigned address = make16(blob[1], blob[2]);
-    unsigned type = blob[3];
-    if (count != bloblen - MIN_BYTES || address + count > 0x10000)
+    uint8_t header[4];
+    int sum = decode(header, &line[1], 4);
+    unsigned count = header[0];
+    unsigned address = make16(header[1], header[2]);
+    unsigned type = header[3];
+    pc->error = "bad hex digit";
+    if (sum < 0)
+        return -1;
+    pc->error = "bad byte count";
+    if (count != (length - MIN_LINE) / 2 || address + count > 0x10000)
         return -1;
 
-    // verify checksum
-    uint8_t sum = 0;
-    for (size_t i = 0; i < bloblen; ++i)
-        sum += blob[i];
-    if (sum != 0)
+    // get data and checksum
+    uint8_t* data = (ihx != NULL && type == 0 && count > 0) ?
+        ihx_put(ihx, segment + address, NULL, count) : pc->data;
+    int sum_data = decode(data, &line[9], count);
+    uint8_t checksum;
+    int sum_checksum = decode(&checksum, &line[9 + 2 * count], 1);
+    pc->error = "bad hex digit";
+    if (sum_data < 0 || sum_checksum < 0)
+        return -1;
+    pc->error = "bad checksum";
+    if ((sum + sum_data + sum_checksum) & 0xff)
         return -1;
 
+    pc->error = NULL;
     pc->count = count;
     pc->address = address;
     pc->type = type;
-    memcpy(pc->data, &blob[4], count);
     return pc->type;
 }
 
-// convert Intel HEX to Binary image
-int ihx_load(IHX* ihx, unsigned filler, FILE* f)
+// get whole file contents
+// note: memory-mapped if possible
+static char* slurp(FILE* f, size_t* size, bool* mapped)
+{
+#if defined(__unix__)
+    struct stat st;
+    int fd = fileno(f);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && ftell(f) == 0) {
+        void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            posix_madvise(ptr, st.st_size, POSIX_MADV_SEQUENTIAL);
+            *size = st.st_size;
+            *mapped = true;
+            return (char*)ptr;
+        }
+    }
+#endif
+
+    // read stream (pipe, stdin, etc.)
+    char* buf = NULL;
+    size_t sz = 0, alloc = 0;
+    for (;;) {
+        if (sz == alloc)
+            buf = (char*)z_realloc(buf, alloc = alloc ? 2 * alloc : 0x10000);
+        size_t part = fread(buf + sz, 1, alloc - sz, f);
+        if (part == 0)
+            break;
+        sz += part;
+    }
+    *size = sz;
+    *mapped = false;
+    return buf;
+}
+
+// release slurp() memory
+static void unslurp(char* buf, size_t size, bool mapped)
 {
-    size_t segment = 0, blocksize = 0x10000;    // 64 KB
-    size_t start = SIZE_MAX, end = 0, eip = 0;
+#if defined(__unix__)
+    if (mapped) {
+        munmap(buf, size);
+        return;
+    }
+#endif
+    (void)size;
+    (void)mapped;
+    free(buf);
+}
 
-    ihx->image = (uint8_t*)memset(z_malloc(blocksize), min(filler, 255), blocksize);
+// init empty image
+void ihx_init(IHX* ihx)
+{
+    ihx->image = NULL;
     ihx->sz = ihx->base = ihx->entry = 0;
+    ihx->seg = NULL;
+    ihx->nseg = 0;
+}
+
+// free image memory
+void ihx_free(IHX* ihx)
+{
+    for (size_t i = 0; i < ihx->nseg; ++i)
+        free(ihx->seg[i].data);
+    free(ihx->seg);
+    free(ihx->image);
+    ihx_init(ihx);
+}
+
+// find first segment ending at or past address
+static size_t lookup(const IHX* ihx, size_t address)
+{
+    size_t lo = 0, hi = ihx->nseg;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ihx->seg[mid].address + ihx->seg[mid].size < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// grow segment data block
+static void reserve(IHX_SEGMENT* ps, size_t size)
+{
+    if (size > ps->alloc) {
+        ps->alloc = max(size, ps->alloc + ps->alloc / 2);
+        ps->data = (uint8_t*)z_realloc(ps->data, ps->alloc);
+    }
+}
+
+// store data at address
+uint8_t* ihx_put(IHX* ihx, size_t address, const void* data, size_t length)
+{
+    size_t end = address + length;
+    size_t i = lookup(ihx, address);
+    IHX_SEGMENT* ps = &ihx->seg[i];
+
+    if (i < ihx->nseg && ps->address <= end) {
+        // merge all segments overlapping or adjacent to [address, end)
+        size_t j = i + 1;
+        for (; j < ihx->nseg && ihx->seg[j].address <= end; ++j) ;
+        size_t start = min(address, ps->address);
+        size_t stop = max(end, ihx->seg[j - 1].address + ihx->seg[j - 1].size);
+
+        if (start < ps->address) {
+            // prepend
+            size_t offset = ps->address - start;
+            reserve(ps, offset + ps->size);
+            memmove(ps->data + offset, ps->data, ps->size);
+            ps->address = start;
+            ps->size += offset;
+        }
+        reserve(ps, stop - start);
+        for (size_t k = i + 1; k < j; ++k) {
+            IHX_SEGMENT* pk = &ihx->seg[k];
+            memcpy(ps->data + (pk->address - start), pk->data, pk->size);
+            free(pk->data);
+        }
+        ps->size = stop - start;
+
+        // remove merged segments
+        memmove(&ihx->seg[i + 1], &ihx->seg[j], (ihx->nseg - j) * sizeof(IHX_SEGMENT));
+        ihx->nseg -= j - (i + 1);
+    } else {
+        // insert new segment
+        ihx->seg = (IHX_SEGMENT*)z_realloc(ihx->seg,
+            (ihx->nseg + 1) * sizeof(IHX_SEGMENT));
+        ps = &ihx->seg[i];
+        memmove(ps + 1, ps, (ihx->nseg - i) * sizeof(IHX_SEGMENT));
+        ++ihx->nseg;
+        ps->address = address;
+        ps->size = ps->alloc = length;
+        ps->data = (uint8_t*)z_malloc(length);
+    }
+
+    // update image bounds
+    ihx->base = ihx->seg[0].address;
+    ihx->sz = ihx->seg[ihx->nseg - 1].address + ihx->seg[ihx->nseg - 1].size - ihx->base;
 
-    bool found_eof = false;
-    do {
-        char line[MAX_LINE + 3];    // CR+LF+NUL
-        if (fgets(line, sizeof(line), f) == NULL)
+    uint8_t* ptr = ps->data + (address - ps->address);
+    if (data != NULL)
+        memcpy(ptr, data, length);
+    return ptr;
+}
+
+// copy memory range to buffer
+size_t ihx_read(const IHX* ihx, size_t address, void* buffer, size_t length,
+    unsigned filler)
+{
+    size_t end = address + length, found = 0;
+    memset(buffer, min(filler, 255), length);
+
+    for (size_t i = lookup(ihx, address); i < ihx->nseg; ++i) {
+        const IHX_SEGMENT* ps = &ihx->seg[i];
+        if (ps->address >= end)
             break;
+        size_t start = max(address, ps->address);
+        size_t stop = min(end, ps->address + ps->size);
+        if (start < stop) {
+            memcpy((uint8_t*)buffer + (start - address), ps->data + (start - ps->address),
+                stop - start);
+            found += stop - start;
+        }
+    }
+
+    return found;
+}
+
+// build contiguous view
+uint8_t* ihx_image(IHX* ihx, unsigned filler)
+{
+    free(ihx->image);
+    ihx->image = (uint8_t*)z_malloc(ihx->sz);
+    ihx_read(ihx, ihx->base, ihx->image, ihx->sz, filler);
+    return ihx->image;
+}
+
+// load Intel HEX or Binary file
+int ihx_load(IHX* ihx, unsigned filler, FILE* f)
+{
+    size_t segment = 0, eip = 0;
+    bool found_eip = false, found_eof = false;
+
+    // gaps are filled on output (ihx_read/ihx_image)
+    (void)filler;
+    ihx_init(ihx);
+
+    size_t size;
+    bool mapped;
+    char* buf = slurp(f, &size, &mapped);
+
+    for (const char* line = buf, *end = buf + size; line < end && !found_eof; ) {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
 
         CHUNK chunk;
-        switch (parse_record(&chunk, line)) {
+        switch (parse_record(&chunk, line, eol - line, ihx, segment)) {
         case 0: /* DATA */
-            if (chunk.count > 0) {
-                // parse_record() guarantees never getting past 64 KB
-                memcpy(ihx->image + segment + chunk.address, chunk.data, chunk.count);
-                start = min(start, segment + chunk.address);
-                end = max(end, segment + chunk.address + chunk.count);
-            }
         break;
         case 1: /* EOF */
             found_eof = (chunk.count == 0);
@@ -137,14 +339,6 @@ int ihx_load(IHX* ihx, unsigned filler, FILE* f)
             if (chunk.count == 2) {
                 segment = make16(chunk.data[0], chunk.data[1]);
                 segment <<= (chunk.type == 2) ? 4 : 16;
-                // grow image if less than 64 KB remaining
-                if (segment + 0x10000 > blocksize) {
-                    size_t newsize = segment + 0x100000; // +1 MB
-                    ihx->image = (uint8_t*)z_realloc(ihx->image, newsize);
-                    memset(ihx->image + blocksize, min(filler, 255),
-                        newsize - blocksize);
-                    blocksize = newsize;
-                }
             }
         break;
         case 3: /* CS:IP */
@@ -153,113 +347,340 @@ int ihx_load(IHX* ihx, unsigned filler, FILE* f)
                 eip = make16(chunk.data[0], chunk.data[1]);
                 eip <<= (chunk.type == 3) ? 4 : 16;
                 eip += make16(chunk.data[2], chunk.data[3]);
+                found_eip = true;
             }
         break;
         case -1:
         default:
             // assume Binary file
-            if (fseek(f, 0, SEEK_END) == 0) {
-                long t = ftell(f);
-                if (t > 0) {
-                    fseek(f, 0, SEEK_SET);
-                    ihx->image = (uint8_t*)z_realloc(ihx->image, t);
-                    ihx->sz = fread(ihx->image, 1, t, f);
-                    return 'b';
-                }
-            }
-            free(ihx->image);
-            ihx->image = NULL;
-            return -1;
+            ihx_free(ihx);
+            if (size > 0)
+                ihx_put(ihx, 0, buf, size);
+            unslurp(buf, size, mapped);
+            return (size > 0) ? 'b' : -1;
         break;
         }
-    } while (!found_eof);
-
-    if (start < end) {
-        // rebase image
-        if (start > 0)
-            memmove(ihx->image, ihx->image + start, end - start);
-        ihx->sz = end - start;
-        ihx->base = start;
-        ihx->entry = (start <= eip && eip < end) ? eip : start;
+
+        line = eol + 1;
     }
+    unslurp(buf, size, mapped);
+
+    if (found_eip && ihx->base <= eip && eip < ihx->base + ihx->sz)
+        ihx->entry = eip;
+    else
+        ihx->entry = ihx->base;
 
-    // shrink memory block
-    ihx->image = (uint8_t*)z_realloc(ihx->image, ihx->sz);
+    // shrink memory blocks
+    for (size_t i = 0; i < ihx->nseg; ++i) {
+        IHX_SEGMENT* ps = &ihx->seg[i];
+        ps->data = (uint8_t*)z_realloc(ps->data, ps->alloc = ps->size);
+    }
     return 'x';
 }
 
-// format output as Intel HEX file
-void ihx_dump(IHX* ihx, unsigned filler, unsigned wrap, FILE* f)
+// read what is available now (0 at end of stream, -1 on error)
+// note: no stdio buffering, so a slow pipe is parsed as data arrives
+static ssize_t read_some(FILE* f, void* buffer, size_t length)
 {
-    size_t segment = ihx->base & 0xffff0000;    // over 64 KB
-    bool use32 = (ihx->sz > 0x100000);          // size > 1 MB
-
-    if (wrap == 0)
-        wrap = 16;
-
-    for (size_t i = 0; i < ihx->sz; ) {
-        // segment overrun
-        if (segment <= ihx->base + i) {
-            // address output
-            if (segment > 0) {
-                unsigned type, high;
-                if (use32) {
-                    type = 4;   // HIWORD(ADDRESS32)
-                    high = segment >> 16;
-                } else {
-                    type = 2;   // CS
-                    high = segment >> 4;
+#if defined(__unix__) || defined(_WIN32)
+    for (;;) {
+        ssize_t part = read(fileno(f), buffer, length);
+        if (part >= 0 || errno != EINTR)
+            return part;
+    }
+#else
+    size_t part = fread(buffer, 1, length, f);
+    return (part == 0 && ferror(f)) ? -1 : (ssize_t)part;
+#endif
+}
+
+// parse Intel HEX or Binary stream
+int ihx_stream(IHX_STREAM* pst, FILE* f, IHX_CALLBACK cb, void* arg)
+{
+    enum { BUFSZ = 0x10000 };
+    char* buf = (char*)z_malloc(BUFSZ);
+    size_t pos = 0, len = 0, segment = 0;
+    int fmt = 0;        // undecided
+    bool found_eof = false, eos = false;
+
+    pst->line = 0;
+    pst->error = NULL;
+
+    while (!found_eof) {
+        // refill buffer (keep everything while format is undecided)
+        if (!eos) {
+            if (fmt != 0) {
+                memmove(buf, buf + pos, len - pos);
+                len -= pos;
+                pos = 0;
+            }
+            ssize_t part = read_some(f, buf + len, BUFSZ - len);
+            if (part < 0) {
+                pst->error = strerror(errno);
+                fmt = -1;
+                break;
+            }
+            eos = (part == 0);
+            len += part;
+        }
+
+        // Binary
+        if (fmt == 'b') {
+            if (pos < len && cb(arg, segment, (uint8_t*)buf + pos, len - pos) != 0) {
+                pst->error = "cancelled";
+                fmt = -1;
+                break;
+            }
+            segment += len - pos;
+            pos = len;
+            if (eos)
+                break;
+            continue;
+        }
+
+        // Intel HEX: process complete lines
+        for (;;) {
+            const char* line = buf + pos;
+            const char* eol = (const char*)memchr(line, '\n', len - pos);
+            if (eol == NULL) {
+                if (!eos && (len - pos) < BUFSZ && (fmt != 0 || len < BUFSZ))
+                    break;      // need more data
+                if (pos == len)
+                    break;      // all done
+                eol = buf + len;
+            }
+            ++pst->line;
+
+            CHUNK chunk;
+            int type = parse_record(&chunk, line, eol - line, NULL, segment);
+            if (type < 0 && fmt == 0) {
+                // assume Binary file
+                fmt = 'b';
+                pos = 0;
+                break;
+            }
+            if (chunk.type >= 0)
+                fmt = 'x';
+            pos = min((size_t)(eol - buf) + 1, len);
+
+            switch (type) {
+            case 0: /* DATA */
+                if (chunk.count > 0 && cb(arg, segment + chunk.address, chunk.data,
+                    chunk.count) != 0) {
+                    pst->error = "cancelled";
+                    fmt = -1;
+                }
+            break;
+            case 1: /* EOF */
+                found_eof = (chunk.count == 0);
+            break;
+            case 2: /* CS */
+            case 4: /* HIWORD(ADDRESS32) */
+                if (chunk.count == 2) {
+                    segment = make16(chunk.data[0], chunk.data[1]);
+                    segment <<= (chunk.type == 2) ? 4 : 16;
                 }
-                int sum = 2 + type + sum8(high);
-                fprintf(f, ":020000%02X%04X%02X\n", type, high, (uint8_t)(-sum));
+            break;
+            case -1:
+                pst->error = chunk.error;
+                fmt = -1;
+            break;
             }
-            segment += 0x10000; // +64 KB
+            if (fmt < 0 || found_eof)
+                break;
         }
+        if (fmt < 0 || (eos && pos == len && fmt != 'b'))
+            break;
+    }
 
-        // max number of bytes on line
-        unsigned cb_max = segment - ihx->base - i;
-        cb_max = min(cb_max, ihx->sz - i);
-        cb_max = min(cb_max, wrap);
-
-        // skip trailing bytes
-        unsigned cb_line = cb_max;
-        if (filler <= 255)
-            for (; cb_line > 0; --cb_line)
-                if (ihx->image[i + cb_line - 1] != filler)
-                    break;
-
-        if (cb_line > 0) {
-            // : count address type(00)
-            fprintf(f, ":%02X%04X00", cb_line, (uint16_t)(ihx->base + i));
-            int sum = cb_line + sum8(ihx->base + i);
-            // data
-            for (unsigned j = 0; j < cb_line; ++j) {
-                fprintf(f, "%02X", ihx->image[i + j]);
-                sum += ihx->image[i + j];
+    free(buf);
+    if (fmt < 0)
+        return -1;
+    return (fmt == 0) ? 'x' : fmt;
+}
+
+// buffered output
+struct IHX_WRITER {
+    FILE* f;            // stdio stream or
+    int fd;             // file descriptor
+    unsigned filler, wrap;
+    bool use32;         // HIWORD(ADDRESS32) or CS records
+    size_t segment;     // over 64 KB
+    size_t address;     // pending line
+    unsigned count;
+    uint8_t line[255];
+    int err;            // errno of the first failed write
+    size_t len;
+    char buf[0x10000];
+};
+
+// note: after a write error output is discarded (see ihx_writer_close)
+static void sink_flush(IHX_WRITER* pw)
+{
+    if (pw->err != 0) {
+        // already failed
+    } else if (pw->f != NULL) {
+        if (fwrite(pw->buf, 1, pw->len, pw->f) != pw->len)
+            pw->err = (errno != 0) ? errno : EIO;
+    } else {
+        for (size_t sz = 0; sz < pw->len; ) {
+            int part = write(pw->fd, pw->buf + sz, (unsigned)(pw->len - sz));
+            if (part < 0 && errno == EINTR)
+                continue;
+            if (part <= 0) {
+                pw->err = (part < 0) ? errno : EIO;
+                break;
             }
-            // checksum
-            fprintf(f, "%02X\n", (uint8_t)(-sum));
+            sz += part;
         }
+    }
+    pw->len = 0;
+}
+
+// format one record
+static void sink_record(IHX_WRITER* pw, unsigned type, unsigned address,
+    const uint8_t* data, unsigned count)
+{
+    static const char nibble[16] = "0123456789ABCDEF";
+
+    // ":" + count address type + data + checksum + "\n"
+    if (pw->len + 1 + 2 * (MIN_BYTES + count) + 1 > sizeof(pw->buf))
+        sink_flush(pw);
+    char* ptr = pw->buf + pw->len;
 
-        // advance index
-        i += cb_max;
+    uint8_t header[4] = { count, address >> 8, address, type };
+    unsigned sum = 0;
+    *ptr++ = ':';
+    for (unsigned i = 0; i < 4; ++i) {
+        *ptr++ = nibble[header[i] >> 4];
+        *ptr++ = nibble[header[i] & 15];
+        sum += header[i];
     }
+    for (unsigned i = 0; i < count; ++i) {
+        *ptr++ = nibble[data[i] >> 4];
+        *ptr++ = nibble[data[i] & 15];
+        sum += data[i];
+    }
+    sum = (uint8_t)(-sum);
+    *ptr++ = nibble[sum >> 4];
+    *ptr++ = nibble[sum & 15];
+    *ptr++ = '\n';
+
+    pw->len = ptr - pw->buf;
+}
+
+// format pending line
+static void sink_line(IHX_WRITER* pw)
+{
+    // segment overrun
+    if ((pw->address & ~(size_t)0xffff) != pw->segment) {
+        pw->segment = pw->address & ~(size_t)0xffff;
+        // address output
+        unsigned high = pw->use32 ? (pw->segment >> 16) : (pw->segment >> 4);
+        uint8_t data[2] = { high >> 8, high };
+        // HIWORD(ADDRESS32) or CS
+        sink_record(pw, pw->use32 ? 4 : 2, 0, data, 2);
+    }
+
+    // skip trailing bytes
+    unsigned cb_line = pw->count;
+    if (pw->filler <= 255)
+        for (; cb_line > 0; --cb_line)
+            if (pw->line[cb_line - 1] != pw->filler)
+                break;
+
+    // : count address type(00) data checksum
+    if (cb_line > 0)
+        sink_record(pw, 0, pw->address, pw->line, cb_line);
+    pw->count = 0;
+}
+
+// start Intel HEX output
+IHX_WRITER* ihx_writer(FILE* f, int fd, unsigned filler, unsigned wrap, size_t end)
+{
+    IHX_WRITER* pw = (IHX_WRITER*)z_malloc(sizeof(IHX_WRITER));
+    pw->f = f;
+    pw->fd = fd;
+    pw->filler = filler;
+    pw->wrap = (wrap == 0) ? 16 : min(wrap, 255);
+    pw->use32 = (end > 0x100000);   // address > 1 MB
+    pw->segment = 0;
+    pw->count = 0;
+    pw->err = 0;
+    pw->len = 0;
+    return pw;
+}
+
+// format data (in ascending address order)
+void ihx_write(IHX_WRITER* pw, size_t address, const void* data, size_t length)
+{
+    const uint8_t* ptr = (const uint8_t*)data;
+    while (length > 0) {
+        // new line unless continued
+        if (pw->count > 0 && pw->address + pw->count != address)
+            sink_line(pw);
+        if (pw->count == 0)
+            pw->address = address;
+
+        // max number of bytes on line
+        size_t n = min(length, pw->wrap - pw->count);
+        n = min(n, 0x10000 - (address & 0xffff));
+        memcpy(&pw->line[pw->count], ptr, n);
+        pw->count += n;
+        address += n;
+        ptr += n;
+        length -= n;
+
+        if (pw->count == pw->wrap || (address & 0xffff) == 0)
+            sink_line(pw);
+    }
+}
+
+// finish Intel HEX output
+int ihx_writer_close(IHX_WRITER* pw, size_t entry)
+{
+    if (pw->count > 0)
+        sink_line(pw);
 
     // start address
-    if (ihx->entry > 0) {
-        unsigned type, high;
-        if (use32) {
-            type = 5;
-            high = ihx->entry >> 16;
-        } else {
-            type = 3;
-            high = (ihx->entry & 0xf0000) >> 4;
-        }
-        int sum = 4 + type + sum8(high + ihx->entry);
-        fprintf(f, ":040000%02X%04X%04X%02X\n", type, high, (uint16_t)ihx->entry,
-            (uint8_t)(-sum));
+    if (entry > 0) {
+        unsigned high = pw->use32 ? (entry >> 16) : ((entry & 0xf0000) >> 4);
+        uint8_t data[4] = { high >> 8, high, entry >> 8, entry };
+        // EIP or CS:IP
+        sink_record(pw, pw->use32 ? 5 : 3, 0, data, 4);
     }
 
     // EOF record
-    fputs(":00000001FF\n", f);
+    sink_record(pw, 1, 0, NULL, 0);
+    sink_flush(pw);
+    if (pw->err == 0 && pw->f != NULL && fflush(pw->f) != 0)
+        pw->err = (errno != 0) ? errno : EIO;
+
+    int err = pw->err;
+    free(pw);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// format output as Intel HEX
+static int dump(IHX* ihx, IHX_WRITER* pw)
+{
+    for (size_t k = 0; k < ihx->nseg; ++k)
+        ihx_write(pw, ihx->seg[k].address, ihx->seg[k].data, ihx->seg[k].size);
+    return ihx_writer_close(pw, ihx->entry);
+}
+
+// format output as Intel HEX file
+int ihx_dump(IHX* ihx, unsigned filler, unsigned wrap, FILE* f)
+{
+    return dump(ihx, ihx_writer(f, -1, filler, wrap, ihx->base + ihx->sz));
+}
+
+// format output as Intel HEX file (w/o stdio)
+int ihx_dump_fd(IHX* ihx, unsigned filler, unsigned wrap, int fd)
+{
+    return dump(ihx, ihx_writer(NULL, fd, filler, wrap, ihx->base + ihx->sz));
 }
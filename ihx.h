@@ -10,31 +10,90 @@ extern "C" {
 #endif
 
 typedef struct {
-    uint8_t* image;
+    size_t address, size, alloc;
+    uint8_t* data;
+} IHX_SEGMENT;
+
+typedef struct {
+    uint8_t* image;     // contiguous view (see ihx_image)
     size_t sz, base, entry;
+    IHX_SEGMENT* seg;   // sorted, non-overlapping
+    size_t nseg;
 } IHX;
 
+// init empty image
+void ihx_init(IHX* ihx);
+
+// free image memory
+void ihx_free(IHX* ihx);
+
+// store data at address
+// if data == NULL then only reserve space
+// return pointer to stored data (valid until next ihx_put)
+uint8_t* ihx_put(IHX* ihx, size_t address, const void* data, size_t length);
+
+// copy memory range to buffer (gaps are set to filler)
+// return number of bytes found in segments
+size_t ihx_read(const IHX* ihx, size_t address, void* buffer, size_t length,
+    unsigned filler);
+
+// build contiguous view of [base, base + sz)
+uint8_t* ihx_image(IHX* ihx, unsigned filler);
+
 // load Intel HEX or Binary file
-// note: may fseek(f), caller must free(image)
+// note: reads f to the end (memory-mapped if possible), caller must ihx_free()
 int ihx_load(IHX* ihx, unsigned filler, FILE* f);
 // IHX ihx;
 // int fmt = ihx_load(&ihx, 0xff, f);
 // if (fmt < 0) {
 //     assert(fmt == -1);
-//     assert(ihx.image == NULL);
+//     assert(ihx.nseg == 0);
 //     assert(ihx.sz == 0);
 //     assert(ihx.base == 0 && ihx.entry == 0);
 // } else {
 //     assert(fmt == 'x' || fmt == 'b');
-//     assert(ihx.image != NULL);
+//     assert(ihx.nseg > 0 && ihx.image == NULL);
 //     assert(ihx.sz > 0);
 //     assert(ihx.base <= ihx.entry && ihx.entry < ihx.base + ihx.sz);
 // }
+// ihx_free(&ihx);
+
+// parse Intel HEX or Binary file as stream
+// note: never seeks f, memory use is bounded; reads the file descriptor of f
+// directly, so records are parsed as soon as they arrive (e.g., through a pipe)
+// callback gets data in file order, non-zero result stops parsing
+typedef int (*IHX_CALLBACK)(void* arg, size_t address, const uint8_t* data,
+    size_t length);
+typedef struct {
+    size_t line;        // current line number
+    const char* error;  // reason of failure
+} IHX_STREAM;
+int ihx_stream(IHX_STREAM* pst, FILE* f, IHX_CALLBACK cb, void* arg);
+// IHX_STREAM st;
+// if (ihx_stream(&st, f, cb, arg) < 0)
+//     printf("line %zu: %s\n", st.line, st.error);
 
 // format output as Intel HEX file
 // if filler <= 255 then may skip consecutive "filler" bytes
-// if wrap == 0 then use default value (16)
-void ihx_dump(IHX* ihx, unsigned filler, unsigned wrap, FILE* f);
+// if wrap == 0 then use default value (16), max. is 255
+// return 0 or -1 on write error (errno set)
+int ihx_dump(IHX* ihx, unsigned filler, unsigned wrap, FILE* f);
+// same to file descriptor (no stdio)
+int ihx_dump_fd(IHX* ihx, unsigned filler, unsigned wrap, int fd);
+
+// incremental Intel HEX output
+// if f == NULL then write to fd; end is max. address (selects record types)
+typedef struct IHX_WRITER IHX_WRITER;
+IHX_WRITER* ihx_writer(FILE* f, int fd, unsigned filler, unsigned wrap, size_t end);
+void ihx_write(IHX_WRITER* pw, size_t address, const void* data, size_t length);
+// note: the first write error stops output, ihx_writer_close() then returns -1
+// (errno set)
+int ihx_writer_close(IHX_WRITER* pw, size_t entry);
+// IHX_WRITER* pw = ihx_writer(stdout, -1, 0xff, 0, base + sz);
+// for (size_t i = 0; i < sz; i += psz)
+//     ihx_write(pw, base + i, &image[i], psz);
+// if (ihx_writer_close(pw, base) < 0)
+//     perror("ihx_writer_close");
 
 #if defined(__cplusplus)
 }
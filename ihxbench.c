@@ -0,0 +1,276 @@
+//
+// ihxbench
+//
+// ihx_load and ihx_dump throughput on synthetic images
+// Every case runs in a child process, so peak RSS is its own
+//
+// https://github.com/matveyt/avrtool
+//
+
+#define _DEFAULT_SOURCE
+#include "stdz.h"
+#include "ihx.h"
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// synthetic image: "block" bytes every "stride" bytes from "base"
+static const struct {
+    const char* name;
+    size_t base, stride, block;
+    size_t limit;       // max. data size
+    bool binary;        // write as binary file
+} cases[] = {
+    { "dense", 0, 0, 0, SIZE_MAX, false },
+    { "sparse", 0, 1024, 64, SIZE_MAX, false },
+    { "ext32", 0x08000000, 0, 0, SIZE_MAX, false },
+    { "seg64k", 0, 0, 0, 0xf0000, false },      // stays below 1 MB
+    { "binary", 0, 0, 0, SIZE_MAX, true },
+};
+
+enum { OP_LOAD, OP_DUMP, OP_DUMP_FD };
+static const char* op_name[] = { "load", "dump", "dump_fd" };
+
+// user options
+static struct {
+    size_t size;        // data bytes per image
+    unsigned repeat;    // timed runs per case
+} opt = { 4 << 20, 5 };
+
+static double now(void);
+static int cmp_double(const void* p1, const void* p2);
+static void generate(size_t k, FILE* f);
+static void measure(int op, FILE* f, int out);
+static void run_child(void (*func)(size_t, int, FILE*, int), size_t k, int op, FILE* f,
+    int out, long* maxrss);
+
+/*noreturn*/
+static void usage(int status)
+{
+    if (status != 0)
+        fprintf(stderr, "Try '%s --help' for more information.\n", z_getprogname());
+    else
+        printf(
+"Usage: %s [OPTION]...\n"
+"Measure ihx_load and ihx_dump on synthetic images.\n"
+"\n"
+"-s, --size=MB      Data per image (default 4)\n"
+"-n, --repeat=NUM   Timed runs per case, median is shown (default 5)\n"
+"-h, --help         Show this message and exit\n",
+        z_getprogname());
+    exit(status);
+}
+
+static void parse_args(int argc, char* argv[])
+{
+    z_setprogname(argv[0]);
+
+    static struct z_option lopts[] = {
+        { "size", z_required_argument, NULL, 's' },
+        { "repeat", z_required_argument, NULL, 'n' },
+        { "help", z_no_argument, NULL, 'h' },
+        {0}
+    };
+
+    int c;
+    while ((c = z_getopt_long(argc, argv, "s:n:h", lopts, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            opt.size = (size_t)(strtod(z_optarg, NULL) * (1 << 20));
+        break;
+        case 'n':
+            opt.repeat = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+        break;
+        case '?':
+            usage(EXIT_FAILURE);
+        break;
+        }
+    }
+
+    if (z_optind != argc || opt.size == 0 || opt.repeat == 0)
+        usage(EXIT_FAILURE);
+}
+
+// child entry: generate input file
+static void gen_child(size_t k, int op, FILE* f, int out)
+{
+    (void)op;
+    (void)out;
+    generate(k, f);
+}
+
+// child entry: timed runs
+static void bench_child(size_t k, int op, FILE* f, int out)
+{
+    (void)k;
+    measure(op, f, out);
+}
+
+int main(int argc, char* argv[])
+{
+    parse_args(argc, argv);
+
+    printf("%-8s %-8s %12s %10s %10s\n", "CASE", "OP", "BYTES", "MB/s", "RSS(KB)");
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); ++k) {
+        // generate in a child too, so this process stays small
+        FILE* f = tmpfile();
+        if (f == NULL)
+            z_error(EXIT_FAILURE, errno, "tmpfile");
+        long maxrss;
+        run_child(gen_child, k, 0, f, -1, &maxrss);
+
+        for (int op = OP_LOAD; op <= OP_DUMP_FD; ++op) {
+            int fds[2];
+            if (pipe(fds) < 0)
+                z_error(EXIT_FAILURE, errno, "pipe");
+            run_child(bench_child, k, op, f, fds[1], &maxrss);
+            close(fds[1]);
+
+            double result[2];   // bytes, seconds
+            ssize_t n = read(fds[0], result, sizeof(result));
+            close(fds[0]);
+            if (n != sizeof(result))
+                z_error(EXIT_FAILURE, -1, "%s %s: no result", cases[k].name,
+                    op_name[op]);
+            printf("%-8s %-8s %12.0f %10.1f %10ld\n", cases[k].name, op_name[op],
+                result[0], result[0] / result[1] / (1 << 20), maxrss);
+            fflush(stdout);
+        }
+        fclose(f);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// monotonic clock (s)
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// qsort() callback
+int cmp_double(const void* p1, const void* p2)
+{
+    double d1 = *(const double*)p1, d2 = *(const double*)p2;
+    return (d1 > d2) - (d1 < d2);
+}
+
+// write synthetic image to file
+void generate(size_t k, FILE* f)
+{
+    size_t size = min(opt.size, cases[k].limit);
+    size_t block = cases[k].block ? cases[k].block : size;
+    size_t stride = cases[k].stride ? cases[k].stride : block;
+
+    // xorshift: repeatable data with no filler runs
+    uint8_t* data = (uint8_t*)z_malloc(block);
+    uint32_t x = 2463534242U;
+    IHX ihx;
+    ihx_init(&ihx);
+    for (size_t cnt = 0, address = cases[k].base; cnt < size; cnt += block,
+        address += stride) {
+        size_t n = min(block, size - cnt);
+        for (size_t i = 0; i < n; ++i) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            data[i] = x;
+        }
+        ihx_put(&ihx, address, data, n);
+    }
+    free(data);
+
+    if (cases[k].binary) {
+        for (size_t i = 0; i < ihx.nseg; ++i)
+            fwrite(ihx.seg[i].data, 1, ihx.seg[i].size, f);
+    } else {
+        ihx_dump(&ihx, 0xff, 0, f);
+    }
+    fflush(f);
+    ihx_free(&ihx);
+}
+
+// run op "repeat" times, send bytes and median time to out
+void measure(int op, FILE* f, int out)
+{
+    double* t = (double*)z_malloc(opt.repeat * sizeof(double));
+    double bytes = 0;
+    IHX ihx;
+    ihx_init(&ihx);
+
+    if (op == OP_LOAD) {
+        for (unsigned i = 0; i < opt.repeat; ++i) {
+            rewind(f);
+            double t0 = now();
+            if (ihx_load(&ihx, 0xff, f) < 0)
+                z_error(EXIT_FAILURE, -1, "ihx_load");
+            t[i] = now() - t0;
+            ihx_free(&ihx);
+        }
+        fseek(f, 0, SEEK_END);
+        bytes = ftell(f);
+    } else {
+        rewind(f);
+        if (ihx_load(&ihx, 0xff, f) < 0)
+            z_error(EXIT_FAILURE, -1, "ihx_load");
+        // output size
+        FILE* tmp = tmpfile();
+        if (tmp == NULL)
+            z_error(EXIT_FAILURE, errno, "tmpfile");
+        ihx_dump(&ihx, 0xff, 0, tmp);
+        bytes = ftell(tmp);
+        fclose(tmp);
+
+        FILE* null = fopen("/dev/null", "w");
+        if (null == NULL)
+            z_error(EXIT_FAILURE, errno, "/dev/null");
+        for (unsigned i = 0; i < opt.repeat; ++i) {
+            double t0 = now();
+            if (op == OP_DUMP) {
+                ihx_dump(&ihx, 0xff, 0, null);
+                fflush(null);
+            } else {
+                ihx_dump_fd(&ihx, 0xff, 0, fileno(null));
+            }
+            t[i] = now() - t0;
+        }
+        fclose(null);
+        ihx_free(&ihx);
+    }
+
+    qsort(t, opt.repeat, sizeof(double), cmp_double);
+    double result[2] = { bytes, t[opt.repeat / 2] };
+    if (write(out, result, sizeof(result)) != sizeof(result))
+        z_error(EXIT_FAILURE, errno, "write");
+    free(t);
+}
+
+// fork, run func in child, wait and get its peak RSS (KB)
+void run_child(void (*func)(size_t, int, FILE*, int), size_t k, int op, FILE* f,
+    int out, long* maxrss)
+{
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0)
+        z_error(EXIT_FAILURE, errno, "fork");
+    if (pid == 0) {
+        func(k, op, f, out);
+        fflush(NULL);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0)
+        z_error(EXIT_FAILURE, errno, "wait4");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        z_error(EXIT_FAILURE, -1, "%s: child failed", cases[k].name);
+    *maxrss = ru.ru_maxrss;
+}
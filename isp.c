@@ -1,10 +1,9 @@
 #include "isp.h"
 #include "ucomm.h"
 
-// STK500 execute command and read response
-static int exec(void* buffer, size_t length, intptr_t fd)
+// STK500 read response
+static int reply(void* buffer, size_t length, intptr_t fd)
 {
-    ucomm_putc(fd, ' ');
     int resp = ucomm_getc(fd);
     if (resp != STK_INSYNC)
         return resp;
@@ -13,11 +12,29 @@ static int exec(void* buffer, size_t length, intptr_t fd)
     return ucomm_getc(fd);
 }
 
+// STK500 send command, data and CRC_EOP (one syscall)
+// return STK_OK or -1 if not sent
+static int transmit(const void* cmd, size_t cmdlen, const void* data, size_t datalen,
+    intptr_t fd)
+{
+    UCOMM_IOV iov[] = { { cmd, cmdlen }, { data, datalen }, { " ", 1 } };
+    ssize_t sz = ucomm_writev(fd, iov, 3);
+    return (sz == (ssize_t)(cmdlen + datalen + 1)) ? STK_OK : -1;
+}
+
+// STK500 execute command and read response
+static int exec(const void* cmd, size_t cmdlen, void* buffer, size_t length,
+    intptr_t fd)
+{
+    int resp = transmit(cmd, cmdlen, NULL, 0, fd);
+    return (resp == STK_OK) ? reply(buffer, length, fd) : resp;
+}
+
 // STK500 generic command w/o parameters
 int isp_command(int ch, intptr_t fd)
 {
-    ucomm_putc(fd, ch);
-    return exec(NULL, 0, fd);
+    uint8_t cmd = (uint8_t)ch;
+    return exec(&cmd, 1, NULL, 0, fd);
 }
 
 // STK_SET_DEVICE
@@ -25,16 +42,15 @@ int isp_set_device(int devcode, size_t fsz, size_t psz, intptr_t fd)
 {
     uint8_t cmd[] = { 'B', devcode, 0, 0, 1, 1, 1, 1, 3, 0xff, 0xff, 0xff, 0xff,
         psz >> 8, psz, fsz >> 12, fsz >> 4, fsz >> 24, fsz >> 16, fsz >> 8, fsz };
-    ucomm_write(fd, cmd, sizeof(cmd));
-    return exec(NULL, 0, fd);
+    return exec(cmd, sizeof(cmd), NULL, 0, fd);
 }
 
 // STK_READ_SIGN
 int isp_read_sign(uint32_t* sig, intptr_t fd)
 {
     uint8_t b_out[3];
-    ucomm_putc(fd, 'u');
-    int resp = exec(b_out, sizeof(b_out), fd);
+    uint8_t cmd = 'u';
+    int resp = exec(&cmd, 1, b_out, sizeof(b_out), fd);
     if (resp == STK_OK) {
         *sig = (b_out[0] << 16) | (b_out[1] << 8) | b_out[2];
         if (*sig == 0 || *sig == 0x00ffffff)
@@ -47,31 +63,157 @@ int isp_read_sign(uint32_t* sig, intptr_t fd)
 int isp_load_address(uint32_t address, intptr_t fd)
 {
     uint8_t cmd[] = { 'U', address >> 1, address >> 9 };
-    ucomm_write(fd, cmd, sizeof(cmd));
-    return exec(NULL, 0, fd);
+    return exec(cmd, sizeof(cmd), NULL, 0, fd);
 }
 
 // STK_READ_PAGE
 int isp_read_page(void* buffer, size_t length, intptr_t fd)
 {
     uint8_t cmd[] = { 't', length >> 8, length, 'F' };
-    ucomm_write(fd, cmd, sizeof(cmd));
-    return exec(buffer, length, fd);
+    return exec(cmd, sizeof(cmd), buffer, length, fd);
 }
 
 // STK_PROG_PAGE
 int isp_prog_page(const void* buffer, size_t length, intptr_t fd)
 {
     uint8_t cmd[] = { 'd', length >> 8, length, 'F' };
-    ucomm_write(fd, cmd, sizeof(cmd));
-    ucomm_write(fd, buffer, length);
-    return exec(NULL, 0, fd);
+    int resp = transmit(cmd, sizeof(cmd), buffer, length, fd);
+    return (resp == STK_OK) ? reply(NULL, 0, fd) : resp;
 }
 
 // STK_UNIVERSAL
 int isp_universal(int b1, int b2, int b3, int b4, void* b_out, intptr_t fd)
 {
     uint8_t cmd[] = { 'V', b1, b2, b3, b4 };
-    ucomm_write(fd, cmd, sizeof(cmd));
-    return exec(b_out, 1, fd);
+    return exec(cmd, sizeof(cmd), b_out, 1, fd);
+}
+
+// STK_UNIVERSAL batch
+// note: frames are sent back-to-back and responses parsed in bulk; on error the
+// input is purged, so replies left of the batch do not answer the next command
+int isp_universal_n(const void* cmd, void* b_out, size_t n, intptr_t fd)
+{
+    // "Arduino as ISP" has 64 bytes of serial input buffer and stalls on AT89S
+    // byte writes, so keep frames in flight well below that
+    enum { BATCH = 8 };
+    const uint8_t* ptr = (const uint8_t*)cmd;
+    uint8_t* out = (uint8_t*)b_out;
+
+    while (n > 0) {
+        size_t cnt = (n < BATCH) ? n : BATCH;
+
+        uint8_t frames[BATCH * 6];
+        for (size_t i = 0; i < cnt; ++i, ptr += 4) {
+            frames[i * 6] = 'V';
+            frames[i * 6 + 1] = ptr[0];
+            frames[i * 6 + 2] = ptr[1];
+            frames[i * 6 + 3] = ptr[2];
+            frames[i * 6 + 4] = ptr[3];
+            frames[i * 6 + 5] = ' ';
+        }
+        if (ucomm_write(fd, frames, cnt * 6) != (ssize_t)(cnt * 6)) {
+            ucomm_purge(fd);
+            return -1;
+        }
+
+        // STK_INSYNC b_out STK_OK
+        uint8_t resp[BATCH * 3];
+        ssize_t sz = ucomm_read(fd, resp, cnt * 3);
+        int status = STK_OK;
+        for (size_t i = 0; i < cnt && status == STK_OK; ++i) {
+            if ((ssize_t)(i * 3) >= sz)
+                status = STK_NOSYNC;
+            else if (resp[i * 3] != STK_INSYNC)
+                status = resp[i * 3];
+            else if ((ssize_t)(i * 3 + 2) >= sz)
+                status = STK_NOSYNC;
+            else if (resp[i * 3 + 2] != STK_OK)
+                status = resp[i * 3 + 2];
+            else
+                *out++ = resp[i * 3 + 1];
+        }
+        if (status != STK_OK) {
+            ucomm_purge(fd);
+            return status;
+        }
+        n -= cnt;
+    }
+
+    return STK_OK;
+}
+
+// init command pipeline
+void isp_pipe_init(ISP_PIPE* pp, unsigned window, intptr_t fd)
+{
+    pp->fd = fd;
+    pp->window = (window < 1) ? 1 : (window > ISP_WINDOW_MAX) ? ISP_WINDOW_MAX : window;
+    pp->head = pp->count = 0;
+    pp->address = 0;
+}
+
+// read response for the oldest command in flight
+static int retire(ISP_PIPE* pp)
+{
+    unsigned i = pp->head;
+    pp->head = (pp->head + 1) % ISP_WINDOW_MAX;
+    --pp->count;
+
+    int resp = reply(pp->slot[i].buffer, pp->slot[i].length, pp->fd);
+    if (resp != STK_OK)
+        pp->address = pp->slot[i].address;
+    return resp;
+}
+
+// send command w/o waiting for response
+static int submit(ISP_PIPE* pp, uint32_t address, const void* cmd, size_t cmdlen,
+    const void* data, size_t datalen, void* buffer, size_t length)
+{
+    if (pp->count >= pp->window) {
+        int resp = retire(pp);
+        if (resp != STK_OK)
+            return resp;
+    }
+
+    if (transmit(cmd, cmdlen, data, datalen, pp->fd) != STK_OK) {
+        pp->address = address;
+        return -1;
+    }
+
+    unsigned i = (pp->head + pp->count++) % ISP_WINDOW_MAX;
+    pp->slot[i].buffer = buffer;
+    pp->slot[i].length = length;
+    pp->slot[i].address = address;
+    return STK_OK;
+}
+
+// STK_LOAD_ADDRESS + STK_READ_PAGE
+int isp_pipe_read_page(ISP_PIPE* pp, uint32_t address, void* buffer, size_t length)
+{
+    uint8_t cmd1[] = { 'U', address >> 1, address >> 9 };
+    uint8_t cmd2[] = { 't', length >> 8, length, 'F' };
+    int resp = submit(pp, address, cmd1, sizeof(cmd1), NULL, 0, NULL, 0);
+    if (resp == STK_OK)
+        resp = submit(pp, address, cmd2, sizeof(cmd2), NULL, 0, buffer, length);
+    return resp;
+}
+
+// STK_LOAD_ADDRESS + STK_PROG_PAGE
+int isp_pipe_prog_page(ISP_PIPE* pp, uint32_t address, const void* buffer,
+    size_t length)
+{
+    uint8_t cmd1[] = { 'U', address >> 1, address >> 9 };
+    uint8_t cmd2[] = { 'd', length >> 8, length, 'F' };
+    int resp = submit(pp, address, cmd1, sizeof(cmd1), NULL, 0, NULL, 0);
+    if (resp == STK_OK)
+        resp = submit(pp, address, cmd2, sizeof(cmd2), buffer, length, NULL, 0);
+    return resp;
+}
+
+// wait for all commands in flight
+int isp_pipe_flush(ISP_PIPE* pp)
+{
+    int resp = STK_OK;
+    while (pp->count > 0 && resp == STK_OK)
+        resp = retire(pp);
+    return resp;
 }
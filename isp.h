@@ -20,5 +20,37 @@ int isp_load_address(uint32_t address, intptr_t fd);
 int isp_read_page(void* buffer, size_t length, intptr_t fd);
 int isp_prog_page(const void* buffer, size_t length, intptr_t fd);
 int isp_universal(int b1, int b2, int b3, int b4, void* b_out, intptr_t fd);
+int isp_universal_n(const void* cmd, void* b_out, size_t n, intptr_t fd);
+// uint8_t cmd[][4] = { { 0x50, 0, 0, 0 }, { 0x58, 8, 0, 0 } };
+// uint8_t b_out[2];
+// int resp = isp_universal_n(cmd, b_out, 2, fd);
+
+// pipelined page transfer
+// note: keeps up to "window" commands in flight, responses matched in order
+#define ISP_WINDOW_MAX 16
+
+typedef struct {
+    intptr_t fd;
+    unsigned window, head, count;
+    uint32_t address;   // page address of the failed command
+    struct {
+        void* buffer;
+        size_t length;
+        uint32_t address;
+    } slot[ISP_WINDOW_MAX];
+} ISP_PIPE;
+
+void isp_pipe_init(ISP_PIPE* pp, unsigned window, intptr_t fd);
+int isp_pipe_read_page(ISP_PIPE* pp, uint32_t address, void* buffer, size_t length);
+int isp_pipe_prog_page(ISP_PIPE* pp, uint32_t address, const void* buffer,
+    size_t length);
+int isp_pipe_flush(ISP_PIPE* pp);
+// ISP_PIPE pp;
+// isp_pipe_init(&pp, 4, fd);
+// for (size_t i = 0; i < sz; i += psz)
+//     if (isp_pipe_prog_page(&pp, base + i, &image[i], psz) != STK_OK)
+//         return pp.address;
+// if (isp_pipe_flush(&pp) != STK_OK)
+//     return pp.address;
 
 #endif // ISP_H
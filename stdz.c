@@ -1,8 +1,13 @@
+#if defined(__unix__)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include "stdz.h"
 #if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #elif defined(__unix__)
+#include <pthread.h>
+#include <time.h>
 #include <sys/select.h>
 #endif
 
@@ -281,6 +286,140 @@ void z_delay(uint32_t ms)
 #endif
 }
 
+// monotonic clock (ms)
+uint32_t z_msec(void)
+{
+#if defined(_WIN32)
+    return GetTickCount();
+#elif defined(__unix__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+// thread start routine
+struct _z_thread {
+    void (*func)(void*);
+    void* arg;
+#if defined(_WIN32)
+    HANDLE h;
+#elif defined(__unix__)
+    pthread_t t;
+#endif
+};
+
+#if defined(_WIN32)
+static DWORD WINAPI _z_thread_start(LPVOID param)
+#elif defined(__unix__)
+static void* _z_thread_start(void* param)
+#endif
+{
+    struct _z_thread* pt = (struct _z_thread*)param;
+    pt->func(pt->arg);
+    return 0;
+}
+
+// create thread
+intptr_t z_thread_create(void (*func)(void*), void* arg)
+{
+    struct _z_thread* pt = (struct _z_thread*)z_malloc(sizeof(struct _z_thread));
+    pt->func = func;
+    pt->arg = arg;
+#if defined(_WIN32)
+    pt->h = CreateThread(NULL, 0, _z_thread_start, pt, 0, NULL);
+    if (pt->h == NULL)
+        z_error(EXIT_FAILURE, 0, "CreateThread");
+#elif defined(__unix__)
+    int err = pthread_create(&pt->t, NULL, _z_thread_start, pt);
+    if (err != 0)
+        z_error(EXIT_FAILURE, err, "pthread_create");
+#endif
+    return (intptr_t)pt;
+}
+
+// wait for thread to exit
+void z_thread_join(intptr_t thread)
+{
+    struct _z_thread* pt = (struct _z_thread*)thread;
+#if defined(_WIN32)
+    WaitForSingleObject(pt->h, INFINITE);
+    CloseHandle(pt->h);
+#elif defined(__unix__)
+    pthread_join(pt->t, NULL);
+#endif
+    free(pt);
+}
+
+// counting semaphore
+struct _z_sem {
+#if defined(_WIN32)
+    HANDLE h;
+#elif defined(__unix__)
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned value;
+#endif
+};
+
+// create semaphore
+intptr_t z_sem_create(unsigned value)
+{
+    struct _z_sem* ps = (struct _z_sem*)z_malloc(sizeof(struct _z_sem));
+#if defined(_WIN32)
+    ps->h = CreateSemaphoreA(NULL, value, LONG_MAX, NULL);
+    if (ps->h == NULL)
+        z_error(EXIT_FAILURE, 0, "CreateSemaphore");
+#elif defined(__unix__)
+    pthread_mutex_init(&ps->mutex, NULL);
+    pthread_cond_init(&ps->cond, NULL);
+    ps->value = value;
+#endif
+    return (intptr_t)ps;
+}
+
+// destroy semaphore
+void z_sem_destroy(intptr_t sem)
+{
+    struct _z_sem* ps = (struct _z_sem*)sem;
+#if defined(_WIN32)
+    CloseHandle(ps->h);
+#elif defined(__unix__)
+    pthread_cond_destroy(&ps->cond);
+    pthread_mutex_destroy(&ps->mutex);
+#endif
+    free(ps);
+}
+
+// decrement semaphore (wait if zero)
+void z_sem_wait(intptr_t sem)
+{
+    struct _z_sem* ps = (struct _z_sem*)sem;
+#if defined(_WIN32)
+    WaitForSingleObject(ps->h, INFINITE);
+#elif defined(__unix__)
+    pthread_mutex_lock(&ps->mutex);
+    while (ps->value == 0)
+        pthread_cond_wait(&ps->cond, &ps->mutex);
+    --ps->value;
+    pthread_mutex_unlock(&ps->mutex);
+#endif
+}
+
+// increment semaphore
+void z_sem_post(intptr_t sem)
+{
+    struct _z_sem* ps = (struct _z_sem*)sem;
+#if defined(_WIN32)
+    ReleaseSemaphore(ps->h, 1, NULL);
+#elif defined(__unix__)
+    pthread_mutex_lock(&ps->mutex);
+    ++ps->value;
+    pthread_cond_signal(&ps->cond);
+    pthread_mutex_unlock(&ps->mutex);
+#endif
+}
+
 // error(3) impl.
 void z_error(int status, int errnum, const char* fmt, ...)
 {
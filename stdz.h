@@ -44,6 +44,13 @@ ssize_t z_strscpy(char* dst, const char* src, size_t n);
 char* z_stpecpy(char* dst, char* end, const char* src);
 int z_strerror_r(int errnum, char* buf, size_t n);
 void z_delay(uint32_t ms);
+uint32_t z_msec(void);
+intptr_t z_thread_create(void (*func)(void*), void* arg);
+void z_thread_join(intptr_t thread);
+intptr_t z_sem_create(unsigned value);
+void z_sem_destroy(intptr_t sem);
+void z_sem_wait(intptr_t sem);
+void z_sem_post(intptr_t sem);
 void z_error(int status, int errnum, const char* fmt, ...);
 void z_warnx(const char* fmt, ...);
 void z__warnx(const char* fmt, ...);
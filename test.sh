@@ -0,0 +1,156 @@
+#!/bin/sh
+#
+# test.sh
+#
+# End-to-end avrtool checks against avrsim
+# Usage: test.sh
+#
+
+set -u
+cd "$(dirname "$0")"
+
+for tool in avrtool avrsim; do
+    [ -x ./$tool ] || { echo "$0: ./$tool not built" >&2; exit 1; }
+done
+
+tmp=$(mktemp -d) || exit 1
+trap 'kill $sim 2>/dev/null; rm -rf "$tmp"' EXIT
+sim=
+failed=0
+
+# start avrsim, wait for its pty name
+# usage: start_sim ARGS...
+# sets sim and pty
+start_sim() {
+    rm -f "$tmp/sim"
+    ./avrsim "$@" > "$tmp/sim" 2> "$tmp/sim.err" &
+    sim=$!
+    while [ ! -s "$tmp/sim" ]; do
+        kill -0 $sim 2>/dev/null || { cat "$tmp/sim.err" >&2; exit 1; }
+        sleep 0.05
+    done
+    pty=$(head -n 1 "$tmp/sim")
+}
+
+# Intel HEX DATA records, 16 bytes each
+# usage: hex_records ADDRESS COUNT BYTE (decimal)
+hex_records() {
+    awk -v addr=$1 -v n=$2 -v byte=$3 'BEGIN {
+        for (i = 0; i < n; ++i) {
+            sum = 16 + int(addr / 256) + addr % 256
+            line = sprintf(":10%04X00", addr)
+            for (k = 0; k < 16; ++k) {
+                line = line sprintf("%02X", byte)
+                sum += byte
+            }
+            printf "%s%02X\n", line, (256 - sum % 256) % 256
+            addr += 16
+        }
+    }'
+}
+
+# usage: check NAME CONDITION...
+check() {
+    name=$1; shift
+    if "$@"; then
+        echo "PASS: $name"
+    else
+        echo "FAIL: $name"
+        failed=1
+    fi
+}
+
+# --stream: the first page goes out while the input is still open
+stream_pipe() {
+    start_sim -S 1e9307
+    {
+        # page 0 (64 bytes), then one record of page 1 completes it
+        hex_records 0 4 90      # 'Z'
+        hex_records 64 1 165
+        # wait for page 0 on the wire (trace is written unbuffered)
+        sent=1
+        for i in $(seq 100); do
+            grep -aq ZZZZZZZZZZZZZZZZ "$tmp/trace" 2>/dev/null && break
+            [ $i -lt 100 ] || sent=0
+            sleep 0.05
+        done
+        echo $sent > "$tmp/sent"
+        hex_records 80 3 165
+        echo ":00000001FF"
+    } | ./avrtool -p $pty -b 115200 -X -s --trace="$tmp/trace" - > "$tmp/log" 2>&1
+    status=$?
+    kill $sim; wait $sim 2>/dev/null
+    [ $status -eq 0 ] && [ "$(cat "$tmp/sent")" = 1 ]
+}
+
+# --read: output write errors fail the run
+read_full() {
+    start_sim -S 1e9307
+    ./avrtool -p $pty -b 115200 -r -a 0 -z 8192 /dev/full > "$tmp/log" 2>&1
+    status=$?
+    kill $sim; wait $sim 2>/dev/null
+    [ $status -ne 0 ] && grep -q "No space left" "$tmp/log"
+}
+
+# AT89S: a blank chip switches to page mode after the first page
+at89s_blank() {
+    head -c 8192 /dev/zero | tr '\0' '\377' > "$tmp/flash.bin"
+    hex_records 0 8 90 > "$tmp/image.hex"
+    hex_records 4096 8 165 >> "$tmp/image.hex"
+    echo ":00000001FF" >> "$tmp/image.hex"
+    rm -f "$tmp/trace"
+    start_sim -m at89s -g -i "$tmp/flash.bin"
+    ./avrtool -n -p $pty -b 19200 -V --trace="$tmp/trace" "$tmp/image.hex" \
+        > "$tmp/log" 2>&1
+    status=$?
+    kill $sim; wait $sim 2>/dev/null
+    # STK_PROG_PAGE of the 128 bytes at 4096: 'd', size 0x0080, 'F'
+    [ $status -eq 0 ] &&
+        od -An -v -tx1 "$tmp/trace" | tr -d ' \n' | grep -q 64008046
+}
+
+# --replay: a different image stops at the first differing byte (no relink)
+replay_diverged() {
+    hex_records 0 8 90 > "$tmp/image.hex"
+    echo ":00000001FF" >> "$tmp/image.hex"
+    hex_records 0 8 165 > "$tmp/other.hex"
+    echo ":00000001FF" >> "$tmp/other.hex"
+    rm -f "$tmp/trace"
+    start_sim -S 1e9307
+    ./avrtool -p $pty -b auto -w 4 --trace="$tmp/trace" "$tmp/image.hex" \
+        > "$tmp/log" 2>&1
+    status=$?
+    kill $sim; wait $sim 2>/dev/null
+    [ $status -eq 0 ] || return 1
+    ./avrtool -p none -b auto -w 4 --replay="$tmp/trace" "$tmp/image.hex" \
+        > "$tmp/log" 2>&1 || return 1
+    ./avrtool -p none -b auto -w 4 --replay="$tmp/trace" "$tmp/other.hex" \
+        > "$tmp/log" 2>&1 && return 1
+    # offset of the first 'Z' in the recording
+    offset=$(grep -abo ZZZZ "$tmp/trace" | head -n 1 | cut -d: -f1)
+    grep -q "diverged at offset $offset: Protocol error" "$tmp/log" &&
+        ! grep -q "starting over" "$tmp/log"
+}
+
+# avrsim --busy-write: Optiboot takes --window=1 only
+# usage: busy_write WINDOW
+busy_write() {
+    start_sim -S 1e9307 -B
+    ./avrtool -p $pty -b 115200 -X -w $1 "$tmp/image.hex" > "$tmp/log" 2>&1
+    status=$?
+    kill $sim; wait $sim 2>/dev/null
+    return $status
+}
+busy_window() {
+    hex_records 0 16 90 > "$tmp/image.hex"
+    echo ":00000001FF" >> "$tmp/image.hex"
+    busy_write 1 && ! busy_write 4
+}
+
+check "stream: first page sent before EOF" stream_pipe
+check "at89s: page mode on a blank chip" at89s_blank
+check "replay: divergence is reported with its offset" replay_diverged
+check "avrsim: page write drops pipelined input" busy_window
+[ -w /dev/full ] && check "read: write error is reported" read_full
+
+exit $failed
@@ -5,7 +5,11 @@
 // https://github.com/matveyt/ucomm
 //
 
+#if defined(__linux__)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include "ucomm.h"
+#include <errno.h>
 
 #if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
@@ -15,6 +19,7 @@
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #if !defined(O_CLOEXEC)
 #define O_CLOEXEC 0
 #endif // O_CLOEXEC
@@ -23,6 +28,579 @@
 #endif // TIOCINQ
 #endif
 
+#if defined(__linux__) && defined(TCGETS2) && !defined(__mips__) && !defined(__sparc__)
+// <asm/termbits.h> conflicts with <termios.h>
+#define UCOMM_TERMIOS2
+struct termios2 {
+    tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed, c_ospeed;
+};
+#define T2_CBAUD 0010017
+#define T2_BOTHER 0010000
+#define T2_IBSHIFT 16
+#endif
+
+#if defined(UCOMM_ASYNC)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/serial.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+enum { OP_IDLE, OP_PENDING, OP_DONE };
+
+// wire trace: TRACE_MAGIC then records of
+//   varint  time since previous record (us)
+//   varint  length << 2 | type
+//   data    length bytes (TX and RX only; BAUD stores rate in length)
+// varint is little-endian base 128
+#define TRACE_MAGIC "UCOMMTR1"
+enum { TR_TX, TR_RX, TR_PURGE, TR_BAUD, TR_END };
+
+// recorded session played back
+struct ucomm_replay {
+    uint8_t* data;              // whole trace
+    size_t size, pos;           // next record
+    size_t rec;                 // current record offset
+    int type;                   // current record (-1 if consumed)
+    const uint8_t* ptr;         // its data
+    size_t left;                // its bytes not consumed yet
+    int64_t t_rec;              // its time since trace start (us)
+    int64_t base;               // now_us() at recorded time 0
+    unsigned baud;
+    int diverged;               // output did not match
+    size_t offset;              // where (trace file offset)
+};
+
+// read or write in progress
+struct ucomm_op {
+    uint8_t* buffer;
+    size_t length, done;
+    int state;
+    ssize_t result;
+    unsigned ms;                // read: max. time w/o data
+    int64_t expire;             // read: time out at
+    int64_t deadline;           // read: never later than
+    UCOMM_CALLBACK cb;
+    void* arg;
+};
+
+struct ucomm_port;
+
+// event loop (the handle points to it)
+struct ucomm_loop {
+    int epfd;                   // epoll instance
+    struct ucomm_port* ports;   // driven by this loop
+    struct ucomm_port* done;    // with completed operations
+    struct ucomm_port* current; // being called back (NULL if closed meanwhile)
+};
+
+// port state (the handle points to it)
+struct ucomm_port {
+    int fd;
+    struct ucomm_loop* loop;
+    struct ucomm_loop own;      // private loop for blocking calls
+    struct ucomm_port* next;    // in loop->ports
+    struct ucomm_port* next_done;   // in loop->done
+    int queued;                 // is in loop->done
+    int readable, writable;     // no EAGAIN since last edge (EPOLLET)
+    unsigned timeout;           // blocking mode read timeout
+    unsigned deadline;          // max. time per read (0 = none)
+    struct ucomm_op rd, wr;
+    UCOMM_STATS stats;
+    UCOMM_LATENCY lat;
+    int old_flags;              // serial_struct.flags before open
+    int lat_dirty;              // UCOMM_LOWLATENCY settings to undo
+    char lat_path[64];          // sysfs latency_timer ("" if none)
+    int trace;                  // wire trace being recorded (-1 none)
+    int trace_err;              // errno of failed trace write
+    int64_t trace_us;           // time of last record
+    struct ucomm_replay* replay;
+    size_t rx_pos, rx_len;      // read-ahead data
+    uint8_t rx[4096];
+};
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// new port state (not in any loop yet)
+static struct ucomm_port* port_new(int fd)
+{
+    struct ucomm_port* pp = calloc(1, sizeof(struct ucomm_port));
+    if (pp == NULL)
+        return NULL;
+    pp->fd = fd;
+    pp->own.epfd = -1;
+    pp->trace = -1;
+    pp->readable = pp->writable = 1;
+    pp->timeout = UCOMM_DEFAULT_TIMEOUT;
+    pp->lat.async_low_latency = -1;
+    pp->lat.latency_timer = pp->lat.old_latency_timer = -1;
+    return pp;
+}
+
+static struct ucomm_port* port_get(intptr_t fd)
+{
+    if (fd == 0 || fd == -1) {
+        errno = EBADF;
+        return NULL;
+    }
+    return (struct ucomm_port*)fd;
+}
+
+// drive port by loop
+// note: registered once for good, edge-triggered, so idle port never wakes loop up
+static int port_attach(struct ucomm_port* pp, struct ucomm_loop* lp)
+{
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = pp };
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, pp->fd, &ev) < 0)
+        return -1;
+    pp->loop = lp;
+    pp->next = lp->ports;
+    lp->ports = pp;
+    return 0;
+}
+
+static void port_detach(struct ucomm_port* pp)
+{
+    struct ucomm_loop* lp = pp->loop;
+    if (lp == NULL)
+        return;
+    for (struct ucomm_port** p = &lp->ports; *p != NULL; p = &(*p)->next)
+        if (*p == pp) {
+            *p = pp->next;
+            break;
+        }
+    for (struct ucomm_port** p = &lp->done; *p != NULL; p = &(*p)->next_done)
+        if (*p == pp) {
+            *p = pp->next_done;
+            break;
+        }
+    if (lp->current == pp)
+        lp->current = NULL;
+    if (lp->epfd >= 0)
+        epoll_ctl(lp->epfd, EPOLL_CTL_DEL, pp->fd, NULL);
+    pp->loop = NULL;
+}
+
+static void op_finish(struct ucomm_port* pp, struct ucomm_op* op, ssize_t result)
+{
+    op->state = OP_DONE;
+    op->result = result;
+    if (!pp->queued) {
+        // call back in completion order
+        struct ucomm_port** p = &pp->loop->done;
+        while (*p != NULL)
+            p = &(*p)->next_done;
+        *p = pp;
+        pp->next_done = NULL;
+        pp->queued = 1;
+    }
+}
+
+static size_t varint_put(uint8_t* dst, uint64_t value)
+{
+    size_t n = 0;
+    for (; value >= 0x80; value >>= 7)
+        dst[n++] = (uint8_t)(value | 0x80);
+    dst[n++] = (uint8_t)value;
+    return n;
+}
+
+// append record to wire trace
+// note: unbuffered, so the trace is complete up to exit or Ctrl-C; recording stops
+// at the first write error (reported by ucomm_trace)
+static void trace_put(struct ucomm_port* pp, unsigned type, const void* data,
+    size_t length)
+{
+    int64_t now = now_us();
+    uint8_t header[20];
+    size_t n = varint_put(header, now - pp->trace_us);
+    n += varint_put(&header[n], (uint64_t)length << 2 | type);
+    pp->trace_us = now;
+
+    int err = errno;
+    struct iovec v[2] = {
+        { header, n },
+        { (void*)data, (type == TR_TX || type == TR_RX) ? length : 0 },
+    };
+    ssize_t sz = writev(pp->trace, v, 2);
+    if (sz != (ssize_t)(v[0].iov_len + v[1].iov_len)) {
+        pp->trace_err = (sz < 0) ? errno : EIO;
+        close(pp->trace);
+        pp->trace = -1;
+    }
+    errno = err;
+}
+
+// move read-ahead data to buffer
+static size_t rx_take(struct ucomm_port* pp, void* buffer, size_t length)
+{
+    size_t n = (pp->rx_len < length) ? pp->rx_len : length;
+    memcpy(buffer, &pp->rx[pp->rx_pos], n);
+    pp->rx_pos += n;
+    pp->rx_len -= n;
+    return n;
+}
+
+// transfer data (fd is ready or may be ready)
+static void op_read(struct ucomm_port* pp)
+{
+    struct ucomm_op* op = &pp->rd;
+    if (pp->rx_len > 0) {
+        op->done += rx_take(pp, op->buffer + op->done, op->length - op->done);
+        if (op->done == op->length) {
+            ++pp->stats.saved;
+            op_finish(pp, op, op->done);
+            return;
+        }
+    }
+
+    // drain everything available at once (read-ahead buffer is empty)
+    while (pp->readable && op->state == OP_PENDING) {
+        ++pp->stats.reads;
+        ssize_t part = read(pp->fd, pp->rx, sizeof(pp->rx));
+        if (part > 0) {
+            if (pp->trace >= 0)
+                trace_put(pp, TR_RX, pp->rx, part);
+            // short read means input queue is empty
+            pp->readable = ((size_t)part == sizeof(pp->rx));
+            pp->rx_pos = 0;
+            pp->rx_len = part;
+            op->done += rx_take(pp, op->buffer + op->done, op->length - op->done);
+            op->expire = now_ms() + op->ms;
+            if (op->expire > op->deadline)
+                op->expire = op->deadline;
+            if (op->done == op->length)
+                op_finish(pp, op, op->done);
+        } else if (part == 0 || errno == EAGAIN) {
+            pp->readable = 0;
+        } else if (errno != EINTR) {
+            op_finish(pp, op, (op->done > 0) ? (ssize_t)op->done : -1);
+        }
+    }
+}
+
+static void op_write(struct ucomm_port* pp)
+{
+    struct ucomm_op* op = &pp->wr;
+    while (pp->writable && op->state == OP_PENDING) {
+        ++pp->stats.writes;
+        ssize_t part = write(pp->fd, op->buffer + op->done, op->length - op->done);
+        if (part > 0) {
+            if (pp->trace >= 0)
+                trace_put(pp, TR_TX, op->buffer + op->done, part);
+            op->done += part;
+            if (op->done == op->length)
+                op_finish(pp, op, op->done);
+            else
+                pp->writable = 0;   // output queue is full
+        } else if (part == 0 || errno == EAGAIN) {
+            pp->writable = 0;
+        } else if (errno != EINTR) {
+            op_finish(pp, op, (op->done > 0) ? (ssize_t)op->done : -1);
+        }
+    }
+}
+
+// call back completed operations
+static int dispatch(struct ucomm_loop* lp)
+{
+    int n = 0;
+    while (lp->done != NULL) {
+        struct ucomm_port* pp = lp->done;
+        lp->done = pp->next_done;
+        pp->queued = 0;
+        lp->current = pp;
+        for (int i = 0; i < 2 && lp->current == pp; ++i) {
+            struct ucomm_op* op = (i == 0) ? &pp->wr : &pp->rd;
+            if (op->state != OP_DONE)
+                continue;
+            // callback may submit next operation or close port
+            op->state = OP_IDLE;
+            ++n;
+            if (op->cb != NULL)
+                op->cb((intptr_t)pp, op->result, op->arg);
+        }
+    }
+    lp->current = NULL;
+    return n;
+}
+
+// sysfs attribute of USB-serial port
+static void latency_path(int fd, char* path, size_t n)
+{
+    struct stat st;
+    path[0] = '\0';
+    if (fstat(fd, &st) == 0)
+        snprintf(path, n, "/sys/dev/char/%u:%u/device/latency_timer",
+            major(st.st_rdev), minor(st.st_rdev));
+}
+
+static int latency_get(const char* path)
+{
+    int ms = -1;
+    FILE* f = (path[0] != '\0') ? fopen(path, "r") : NULL;
+    if (f != NULL) {
+        if (fscanf(f, "%d", &ms) != 1)
+            ms = -1;
+        fclose(f);
+    }
+    return ms;
+}
+
+// async-signal-safe (see ucomm_restore)
+static int latency_set(const char* path, int ms)
+{
+    char buf[16];
+    size_t n = sizeof(buf);
+    buf[--n] = '\n';
+    do {
+        buf[--n] = '0' + ms % 10;
+        ms /= 10;
+    } while (ms > 0 && n > 0);
+    int f = (path[0] != '\0') ? open(path, O_WRONLY | O_CLOEXEC) : -1;
+    if (f < 0)
+        return -1;
+    int ok = (write(f, buf + n, sizeof(buf) - n) == (ssize_t)(sizeof(buf) - n));
+    return (close(f) == 0 && ok) ? 0 : -1;
+}
+
+// ASYNC_LOW_LATENCY and 1 ms latency timer (FTDI default is 16 ms)
+static void low_latency(struct ucomm_port* pp)
+{
+    struct serial_struct ss;
+    pp->lat.async_low_latency = -1;
+    if (ioctl(pp->fd, TIOCGSERIAL, &ss) == 0) {
+        pp->old_flags = ss.flags;
+        ss.flags |= ASYNC_LOW_LATENCY;
+        pp->lat.async_low_latency = (ioctl(pp->fd, TIOCSSERIAL, &ss) == 0);
+    }
+
+    latency_path(pp->fd, pp->lat_path, sizeof(pp->lat_path));
+    pp->lat.old_latency_timer = pp->lat.latency_timer = latency_get(pp->lat_path);
+    if (pp->lat.latency_timer > 1 && latency_set(pp->lat_path, 1) == 0)
+        pp->lat.latency_timer = latency_get(pp->lat_path);
+    pp->lat_dirty = 1;
+}
+
+// undo low_latency() once (async-signal-safe)
+static void restore_latency(struct ucomm_port* pp)
+{
+    if (!pp->lat_dirty)
+        return;
+    pp->lat_dirty = 0;
+    if (pp->lat.async_low_latency > 0 && !(pp->old_flags & ASYNC_LOW_LATENCY)) {
+        struct serial_struct ss;
+        if (ioctl(pp->fd, TIOCGSERIAL, &ss) == 0) {
+            ss.flags = pp->old_flags;
+            ioctl(pp->fd, TIOCSSERIAL, &ss);
+        }
+    }
+    if (pp->lat.latency_timer != pp->lat.old_latency_timer)
+        latency_set(pp->lat_path, pp->lat.old_latency_timer);
+}
+
+// blocking mode completion
+static void wait_done(intptr_t fd, ssize_t result, void* arg)
+{
+    (void)fd;
+    *(ssize_t*)arg = result;
+}
+
+static ssize_t wait_for(struct ucomm_port* pp, ssize_t* presult)
+{
+    while (*presult == -2) {
+        if (ucomm_run((intptr_t)pp->loop, -1) <= 0 && *presult == -2) {
+            ucomm_cancel((intptr_t)pp);
+            return -1;
+        }
+    }
+    return *presult;
+}
+
+static int varint_get(struct ucomm_replay* rp, uint64_t* pvalue)
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0; rp->pos < rp->size && shift < 64; shift += 7) {
+        uint8_t b = rp->data[rp->pos++];
+        value |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *pvalue = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// get current record type (step over consumed and BAUD ones)
+static int replay_peek(struct ucomm_replay* rp)
+{
+    while (rp->type < 0 || rp->type == TR_BAUD
+        || ((rp->type == TR_TX || rp->type == TR_RX) && rp->left == 0)) {
+        uint64_t delta, word;
+        rp->rec = rp->pos;
+        if (varint_get(rp, &delta) < 0 || varint_get(rp, &word) < 0) {
+            rp->type = TR_END;
+            rp->left = 0;
+            break;
+        }
+        rp->t_rec += delta;
+        rp->type = word & 3;
+        rp->left = word >> 2;
+        if (rp->type == TR_BAUD) {
+            rp->baud = rp->left;
+        } else if (rp->type != TR_PURGE) {
+            if (rp->left > rp->size - rp->pos) {
+                rp->type = TR_END;
+                rp->left = 0;
+                break;
+            }
+            rp->ptr = &rp->data[rp->pos];
+            rp->pos += rp->left;
+        }
+    }
+    return rp->type;
+}
+
+static void replay_sleep(int64_t until)
+{
+    int64_t us = until - now_us();
+    if (us > 0) {
+        struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+// move recorded input to read-ahead buffer (as read() did)
+static void replay_rx(struct ucomm_port* pp)
+{
+    struct ucomm_replay* rp = pp->replay;
+    size_t n = (rp->left < sizeof(pp->rx)) ? rp->left : sizeof(pp->rx);
+    memcpy(pp->rx, rp->ptr, n);
+    pp->rx_pos = 0;
+    pp->rx_len = n;
+    rp->ptr += n;
+    rp->left -= n;
+    ++pp->stats.reads;
+}
+
+// input arrives at recorded time; if output comes next then time out
+static ssize_t replay_read(struct ucomm_port* pp, void* buffer, size_t length)
+{
+    struct ucomm_replay* rp = pp->replay;
+    if (rp->diverged) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    size_t done = 0;
+    int64_t now = now_us();
+    int64_t deadline = pp->deadline ? now + pp->deadline * INT64_C(1000) : INT64_MAX;
+    for (;;) {
+        done += rx_take(pp, (uint8_t*)buffer + done, length - done);
+        if (done == length)
+            break;
+        int64_t limit = now + pp->timeout * INT64_C(1000);
+        if (limit > deadline)
+            limit = deadline;
+        int64_t due = (replay_peek(rp) == TR_END) ? INT64_MAX : rp->base + rp->t_rec;
+        if (rp->type != TR_RX || due > limit) {
+            replay_sleep((due < limit) ? due : limit);
+            break;
+        }
+        replay_sleep(due);
+        now = now_us();
+        replay_rx(pp);
+    }
+    return done;
+}
+
+// output must match the recorded one (counted as one write)
+static ssize_t replay_write(struct ucomm_port* pp, const UCOMM_IOV* iov, int cnt)
+{
+    struct ucomm_replay* rp = pp->replay;
+    ssize_t total = 0;
+    for (int i = 0; i < cnt && !rp->diverged; ++i) {
+        const uint8_t* src = (const uint8_t*)iov[i].buffer;
+        size_t length = iov[i].length;
+        for (size_t done = 0; done < length; ) {
+            int type = replay_peek(rp);
+            if (type == TR_RX && pp->rx_len == 0) {
+                // input arrived before, but was read after
+                replay_rx(pp);
+                continue;
+            }
+            if (type != TR_TX) {
+                rp->diverged = 1;
+                rp->offset = rp->rec;
+                break;
+            }
+            size_t n = (rp->left < length - done) ? rp->left : length - done;
+            for (size_t k = 0; k < n; ++k)
+                if (rp->ptr[k] != src[done + k]) {
+                    rp->diverged = 1;
+                    rp->offset = rp->ptr + k - rp->data;
+                    break;
+                }
+            if (rp->diverged)
+                break;
+            rp->ptr += n;
+            rp->left -= n;
+            done += n;
+        }
+        total += length;
+    }
+    if (rp->diverged) {
+        errno = EPROTO;
+        return -1;
+    }
+    ++pp->stats.writes;
+    rp->base = now_us() - rp->t_rec;
+    return total;
+}
+
+// discard input up to recorded purge
+static void replay_purge(struct ucomm_port* pp)
+{
+    struct ucomm_replay* rp = pp->replay;
+    pp->rx_len = 0;
+    while (replay_peek(rp) == TR_RX)
+        rp->left = 0;
+    if (rp->type == TR_PURGE)
+        rp->type = -1;
+}
+#endif // UCOMM_ASYNC
+
+#if defined(__unix__)
+// OS file descriptor of handle
+static int os_fd(intptr_t fd)
+{
+#if defined(UCOMM_ASYNC)
+    return ((struct ucomm_port*)fd)->fd;
+#else
+    return (int)fd;
+#endif
+}
+#endif
+
 intptr_t ucomm_open(const char* port, unsigned baud, unsigned config)
 {
     intptr_t fd;
@@ -44,6 +622,25 @@ intptr_t ucomm_open(const char* port, unsigned baud, unsigned config)
         fd = (intptr_t)h;
     } else
         fd = -1;
+#elif defined(UCOMM_ASYNC)
+    int os = open(port ? port : "/dev/ttyUSB0", O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+    if (os == -1)
+        return -1;
+    // private event loop for blocking calls
+    struct ucomm_port* pp = port_new(os);
+    if (pp == NULL || (pp->own.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+        || port_attach(pp, &pp->own) < 0) {
+        int err = (pp == NULL) ? ENOMEM : errno;
+        if (pp != NULL && pp->own.epfd >= 0)
+            close(pp->own.epfd);
+        free(pp);
+        close(os);
+        errno = err;
+        return -1;
+    }
+    if (config & UCOMM_LOWLATENCY)
+        low_latency(pp);
+    fd = (intptr_t)pp;
 #elif defined(__unix__)
     fd = open(port ? port : "/dev/ttyUSB0", O_RDWR | O_NOCTTY | O_CLOEXEC);
 #endif
@@ -60,24 +657,47 @@ int ucomm_close(intptr_t fd)
 #if defined(_WIN32)
     return CloseHandle((HANDLE)fd) ? 0 : -1;
 #elif defined(__unix__)
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    ucomm_cancel(fd);
+    port_detach(pp);
+    restore_latency(pp);
+    if (pp->own.epfd >= 0)
+        close(pp->own.epfd);
+    if (pp->trace >= 0)
+        close(pp->trace);
+    if (pp->replay != NULL) {
+        free(pp->replay->data);
+        free(pp->replay);
+    }
+    int os = pp->fd;
+    free(pp);
+    return (os >= 0) ? close(os) : 0;
+#else
     return close(fd);
 #endif
+#endif
 }
 
+#if defined(__unix__)
+static const unsigned ubr[] = {
+#define B(n)    (B##n), (n),
+    B(50) B(75) B(110) B(134) B(150) B(200) B(300) B(600) B(1200) B(1800) B(2400)
+    B(4800) B(9600) B(19200) B(38400) B(57600) B(115200) /*B(128000)*/ B(230400)
+    /*B(256000)*/ B(460800) /*B(500000)*/ /*B(576000)*/ B(921600) /*B(1000000)*/
+    /*B(1152000)*/ /*B(1500000)*/ /*B(2000000)*/ /*B(2500000)*/ /*B(3000000)*/
+    /*B(3500000)*/ /*B(4000000)*/
+#undef B
+};
+#endif
+
 static unsigned baudrate(unsigned baud)
 {
 #if defined(_WIN32)
     return baud ? baud : 115200;
 #elif defined(__unix__)
-    static const unsigned ubr[] = {
-#define B(n)    (B##n), (n),
-        B(50) B(75) B(110) B(134) B(150) B(200) B(300) B(600) B(1200) B(1800) B(2400)
-        B(4800) B(9600) B(19200) B(38400) B(57600) B(115200) /*B(128000)*/ B(230400)
-        /*B(256000)*/ B(460800) /*B(500000)*/ /*B(576000)*/ B(921600) /*B(1000000)*/
-        /*B(1152000)*/ /*B(1500000)*/ /*B(2000000)*/ /*B(2500000)*/ /*B(3000000)*/
-        /*B(3500000)*/ /*B(4000000)*/
-#undef B
-    };
     for (ssize_t i = sizeof(ubr) / sizeof(ubr[0]) - 1; i > 0; i -= 2)
         if (baud >= ubr[i])
             return ubr[i - 1];
@@ -117,8 +737,17 @@ int ucomm_reset(intptr_t fd, unsigned baud, unsigned config)
     ucomm_purge(fd);
     return SetCommState((HANDLE)fd, &dcb) ? 0 : -1;
 #elif defined(__unix__)
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp != NULL && pp->replay != NULL) {
+        // recorded rate
+        pp->rx_len = 0;
+        replay_peek(pp->replay);
+        return 0;
+    }
+#endif
     struct termios tio;
-    tcgetattr(fd, &tio);
+    tcgetattr(os_fd(fd), &tio);
 
     //cfmakeraw(&tio);
     tio.c_iflag &= ~(IGNBRK | BRKINT | IGNPAR | INPCK | ISTRIP | INLCR | IGNCR |
@@ -138,10 +767,60 @@ int ucomm_reset(intptr_t fd, unsigned baud, unsigned config)
     }
     tio.c_cflag |= (stopbits == 2) ? CSTOPB : 0;
     tio.c_cflag |= (CREAD | CLOCAL);
+#if defined(UCOMM_ASYNC)
+    // timeouts are handled by event loop
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+#endif
     speed_t ubr = baudrate(baud);
     cfsetispeed(&tio, ubr);
     cfsetospeed(&tio, ubr);
-    return tcsetattr(fd, TCSAFLUSH, &tio);
+#if defined(UCOMM_ASYNC)
+    if (pp != NULL)
+        pp->rx_len = 0;
+#endif
+    int ret = tcsetattr(os_fd(fd), TCSAFLUSH, &tio);
+#if defined(UCOMM_TERMIOS2)
+    // not in Bxxx table (if driver refuses then keep the nearest one)
+    struct termios2 t2;
+    if (ret == 0 && baud != 0 && ucomm_baud(fd) != baud
+        && ioctl(os_fd(fd), TCGETS2, &t2) == 0) {
+        t2.c_cflag &= ~(T2_CBAUD | (T2_CBAUD << T2_IBSHIFT));
+        t2.c_cflag |= T2_BOTHER;
+        t2.c_ispeed = t2.c_ospeed = baud;
+        ioctl(os_fd(fd), TCSETS2, &t2);
+    }
+#endif
+#if defined(UCOMM_ASYNC)
+    if (pp != NULL && pp->trace >= 0)
+        trace_put(pp, TR_BAUD, NULL, ucomm_baud(fd));
+#endif
+    return ret;
+#endif
+}
+
+unsigned ucomm_baud(intptr_t fd)
+{
+#if defined(_WIN32)
+    DCB dcb = { .DCBlength = sizeof(DCB) };
+    return GetCommState((HANDLE)fd, &dcb) ? dcb.BaudRate : 0;
+#elif defined(UCOMM_TERMIOS2)
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp != NULL && pp->replay != NULL)
+        return pp->replay->baud;
+#endif
+    struct termios2 t2;
+    return (ioctl(os_fd(fd), TCGETS2, &t2) < 0) ? 0 : t2.c_ospeed;
+#elif defined(__unix__)
+    struct termios tio;
+    if (tcgetattr(os_fd(fd), &tio) < 0)
+        return 0;
+    speed_t speed = cfgetospeed(&tio);
+    for (size_t i = 0; i < sizeof(ubr) / sizeof(ubr[0]); i += 2)
+        if (ubr[i] == speed)
+            return ubr[i + 1];
+    return 0;
 #endif
 }
 
@@ -150,7 +829,19 @@ int ucomm_purge(intptr_t fd)
 #if defined(_WIN32)
     return PurgeComm((HANDLE)fd, PURGE_RXCLEAR | PURGE_TXCLEAR) ? 0 : -1;
 #elif defined(__unix__)
-    return tcflush(fd, TCIOFLUSH);
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp != NULL) {
+        pp->rx_len = 0;
+        if (pp->replay != NULL) {
+            replay_purge(pp);
+            return 0;
+        }
+        if (pp->trace >= 0)
+            trace_put(pp, TR_PURGE, NULL, 0);
+    }
+#endif
+    return tcflush(os_fd(fd), TCIOFLUSH);
 #endif
 }
 
@@ -165,6 +856,12 @@ int ucomm_timeout(intptr_t fd, unsigned ms)
         .WriteTotalTimeoutConstant = 0,
     };
     return SetCommTimeouts((HANDLE)fd, &timeouts) ? 0 : -1;
+#elif defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    pp->timeout = ms;
+    return 0;
 #elif defined(__unix__)
     struct termios tio;
     tcgetattr(fd, &tio);
@@ -174,13 +871,29 @@ int ucomm_timeout(intptr_t fd, unsigned ms)
 #endif
 }
 
+int ucomm_deadline(intptr_t fd, unsigned ms)
+{
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    pp->deadline = ms;
+    return 0;
+#else
+    (void)fd;
+    (void)ms;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 int ucomm_dtr(intptr_t fd, int pulldown)
 {
 #if defined(_WIN32)
     return EscapeCommFunction((HANDLE)fd, pulldown ? SETDTR : CLRDTR) ? 0 : - 1;
 #elif defined(__unix__)
     int arg = TIOCM_DTR;
-    return ioctl(fd, pulldown ? TIOCMBIS : TIOCMBIC, &arg);
+    return ioctl(os_fd(fd), pulldown ? TIOCMBIS : TIOCMBIC, &arg);
 #endif
 }
 
@@ -190,7 +903,7 @@ int ucomm_rts(intptr_t fd, int pulldown)
     return EscapeCommFunction((HANDLE)fd, pulldown ? SETRTS : CLRRTS) ? 0 : -1;
 #elif defined(__unix__)
     int arg = TIOCM_RTS;
-    return ioctl(fd, pulldown ? TIOCMBIS : TIOCMBIC, &arg);
+    return ioctl(os_fd(fd), pulldown ? TIOCMBIS : TIOCMBIC, &arg);
 #endif
 }
 
@@ -200,8 +913,22 @@ ssize_t ucomm_available(intptr_t fd)
     COMSTAT stat;
     return ClearCommError((HANDLE)fd, NULL, &stat) ? (LONG)stat.cbInQue : -1;
 #elif defined(__unix__)
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp != NULL && pp->replay != NULL) {
+        struct ucomm_replay* rp = pp->replay;
+        int due = replay_peek(rp) == TR_RX && rp->base + rp->t_rec <= now_us();
+        return pp->rx_len + (due ? rp->left : 0);
+    }
+#endif
     int available;
-    return ioctl(fd, TIOCINQ, &available) < 0 ? -1 : available;
+    if (ioctl(os_fd(fd), TIOCINQ, &available) < 0)
+        return -1;
+#if defined(UCOMM_ASYNC)
+    if (pp != NULL)
+        available += pp->rx_len;
+#endif
+    return available;
 #endif
 }
 
@@ -211,6 +938,8 @@ int ucomm_getc(intptr_t fd)
 #if defined(_WIN32)
     DWORD part;
     ReadFile((HANDLE)fd, &b, sizeof(b), &part, NULL);
+#elif defined(UCOMM_ASYNC)
+    ssize_t part = ucomm_read(fd, &b, sizeof(b));
 #elif defined(__unix__)
     ssize_t part = read(fd, &b, sizeof(b));
 #endif
@@ -223,6 +952,8 @@ int ucomm_putc(intptr_t fd, int ch)
 #if defined(_WIN32)
     DWORD part;
     WriteFile((HANDLE)fd, &b, sizeof(b), &part, NULL);
+#elif defined(UCOMM_ASYNC)
+    ssize_t part = ucomm_write(fd, &b, sizeof(b));
 #elif defined(__unix__)
     ssize_t part = write(fd, &b, sizeof(b));
 #endif
@@ -231,6 +962,16 @@ int ucomm_putc(intptr_t fd, int ch)
 
 ssize_t ucomm_read(intptr_t fd, void* buffer, size_t length)
 {
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    ssize_t result = -2;
+    if (pp != NULL && pp->replay != NULL)
+        return replay_read(pp, buffer, length);
+    if (pp == NULL
+        || ucomm_submit_read(fd, buffer, length, pp->timeout, wait_done, &result) < 0)
+        return -1;
+    return wait_for(pp, &result);
+#else
     ssize_t sz = 0;
     while (sz < (ssize_t)length) {
 #if defined(_WIN32)
@@ -247,10 +988,22 @@ ssize_t ucomm_read(intptr_t fd, void* buffer, size_t length)
         sz += part;
     }
     return sz;
+#endif
 }
 
 ssize_t ucomm_write(intptr_t fd, const void* buffer, size_t length)
 {
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    ssize_t result = -2;
+    if (pp != NULL && pp->replay != NULL) {
+        UCOMM_IOV v = { buffer, length };
+        return replay_write(pp, &v, 1);
+    }
+    if (pp == NULL || ucomm_submit_write(fd, buffer, length, wait_done, &result) < 0)
+        return -1;
+    return wait_for(pp, &result);
+#else
     ssize_t sz = 0;
     while (sz < (ssize_t)length) {
 #if defined(_WIN32)
@@ -267,4 +1020,385 @@ ssize_t ucomm_write(intptr_t fd, const void* buffer, size_t length)
         sz += part;
     }
     return sz;
+#endif
+}
+
+ssize_t ucomm_writev(intptr_t fd, const UCOMM_IOV* iov, int cnt)
+{
+    ssize_t sz = 0, total = 0;
+    if (cnt > UCOMM_IOV_MAX) {
+        // send in chunks, stop at short write
+        for (int i = 0; i < cnt; i += UCOMM_IOV_MAX) {
+            int n = (cnt - i < UCOMM_IOV_MAX) ? cnt - i : UCOMM_IOV_MAX;
+            ssize_t chunk = 0;
+            for (int j = 0; j < n; ++j)
+                chunk += iov[i + j].length;
+            ssize_t part = ucomm_writev(fd, &iov[i], n);
+            if (part < 0)
+                return (sz > 0) ? sz : -1;
+            sz += part;
+            if (part < chunk)
+                break;
+        }
+        return sz;
+    }
+    for (int i = 0; i < cnt; ++i)
+        total += iov[i].length;
+
+#if defined(__unix__)
+    struct iovec v[UCOMM_IOV_MAX];
+    for (int i = 0; i < cnt; ++i) {
+        v[i].iov_base = (void*)iov[i].buffer;
+        v[i].iov_len = iov[i].length;
+    }
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    if (pp->wr.state != OP_IDLE) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (pp->replay != NULL)
+        return replay_write(pp, iov, cnt);
+    ++pp->stats.writes;
+#endif
+    sz = writev(os_fd(fd), v, cnt);
+#if defined(UCOMM_ASYNC)
+    if (sz > 0 && pp->trace >= 0) {
+        ssize_t rest = sz;
+        for (int i = 0; i < cnt && rest > 0; ++i) {
+            size_t n = ((size_t)rest < iov[i].length) ? (size_t)rest : iov[i].length;
+            if (n > 0)
+                trace_put(pp, TR_TX, iov[i].buffer, n);
+            rest -= n;
+        }
+    }
+#endif
+    if (sz == total)
+        return sz;
+    if (sz < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            return -1;
+        sz = 0;
+    }
+#endif
+
+    // write the rest piecewise
+    ssize_t skip = sz;
+    for (int i = 0; i < cnt; ++i) {
+        if (skip >= (ssize_t)iov[i].length) {
+            skip -= iov[i].length;
+            continue;
+        }
+        size_t length = iov[i].length - skip;
+        ssize_t part = ucomm_write(fd, (const uint8_t*)iov[i].buffer + skip, length);
+        if (part < 0)
+            return (sz > 0) ? sz : -1;
+        sz += part;
+        if ((size_t)part < length)
+            break;
+        skip = 0;
+    }
+    return sz;
+}
+
+int ucomm_trace(intptr_t fd, const char* fname)
+{
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    int err = pp->trace_err;
+    if (pp->trace >= 0 && close(pp->trace) < 0 && err == 0)
+        err = errno;
+    pp->trace = -1;
+    pp->trace_err = 0;
+    if (fname == NULL) {
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+        return 0;
+    }
+
+    pp->trace = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (pp->trace < 0)
+        return -1;
+    if (write(pp->trace, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1)
+        != (ssize_t)(sizeof(TRACE_MAGIC) - 1)) {
+        err = errno;
+        close(pp->trace);
+        pp->trace = -1;
+        errno = err;
+        return -1;
+    }
+    pp->trace_us = now_us();
+    trace_put(pp, TR_BAUD, NULL, ucomm_baud(fd));
+    return 0;
+#else
+    (void)fd;
+    (void)fname;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+intptr_t ucomm_replay(const char* fname)
+{
+#if defined(UCOMM_ASYNC)
+    // no device and no event loop
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    struct ucomm_replay* rp = calloc(1, sizeof(struct ucomm_replay));
+    if (rp == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        rp->data = malloc(st.st_size);
+    if (rp->data != NULL)
+        rp->size = read(fd, rp->data, st.st_size);
+    close(fd);
+    if (rp->data == NULL || rp->size != (size_t)st.st_size
+        || rp->size < sizeof(TRACE_MAGIC) - 1
+        || memcmp(rp->data, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != 0) {
+        free(rp->data);
+        free(rp);
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct ucomm_port* pp = port_new(-1);
+    if (pp == NULL) {
+        free(rp->data);
+        free(rp);
+        errno = ENOMEM;
+        return -1;
+    }
+    pp->replay = rp;
+    rp->pos = sizeof(TRACE_MAGIC) - 1;
+    rp->type = -1;
+    rp->base = now_us();
+    replay_peek(rp);
+    return (intptr_t)pp;
+#else
+    (void)fname;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+ssize_t ucomm_diverged(intptr_t fd)
+{
+#if defined(UCOMM_ASYNC)
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL || pp->replay == NULL || !pp->replay->diverged)
+        return -1;
+    return pp->replay->offset;
+#else
+    (void)fd;
+    return -1;
+#endif
+}
+
+#if defined(UCOMM_ASYNC)
+intptr_t ucomm_loop(void)
+{
+    struct ucomm_loop* lp = calloc(1, sizeof(struct ucomm_loop));
+    if (lp == NULL)
+        return -1;
+    lp->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (lp->epfd < 0) {
+        free(lp);
+        return -1;
+    }
+    return (intptr_t)lp;
+}
+
+int ucomm_loop_close(intptr_t loop)
+{
+    if (loop == 0 || loop == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    struct ucomm_loop* lp = (struct ucomm_loop*)loop;
+    // ports would be left pointing to freed loop
+    if (lp->ports != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    int ret = close(lp->epfd);
+    free(lp);
+    return ret;
+}
+
+intptr_t ucomm_open_async(intptr_t loop, const char* port, unsigned baud,
+    unsigned config)
+{
+    intptr_t fd = ucomm_open(port, baud, config);
+    if (fd != -1) {
+        // move to shared loop
+        struct ucomm_port* pp = (struct ucomm_port*)fd;
+        port_detach(pp);
+        close(pp->own.epfd);
+        pp->own.epfd = -1;
+        if (port_attach(pp, (struct ucomm_loop*)loop) < 0) {
+            int err = errno;
+            ucomm_close(fd);
+            errno = err;
+            return -1;
+        }
+    }
+    return fd;
+}
+
+int ucomm_submit_read(intptr_t fd, void* buffer, size_t length, unsigned ms,
+    UCOMM_CALLBACK cb, void* arg)
+{
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    if (pp->replay != NULL) {
+        errno = ENOSYS;
+        return -1;
+    }
+    struct ucomm_op* op = &pp->rd;
+    if (op->state != OP_IDLE) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    int64_t now = now_ms();
+    *op = (struct ucomm_op){
+        .buffer = buffer,
+        .length = length,
+        .state = OP_PENDING,
+        .ms = ms,
+        .expire = now + ms,
+        .deadline = pp->deadline ? now + pp->deadline : INT64_MAX,
+        .cb = cb,
+        .arg = arg,
+    };
+    if (op->expire > op->deadline)
+        op->expire = op->deadline;
+    // data may be here already
+    if (length > 0)
+        op_read(pp);
+    else
+        op_finish(pp, op, 0);
+    return 0;
+}
+
+int ucomm_submit_write(intptr_t fd, const void* buffer, size_t length,
+    UCOMM_CALLBACK cb, void* arg)
+{
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    if (pp->replay != NULL) {
+        errno = ENOSYS;
+        return -1;
+    }
+    struct ucomm_op* op = &pp->wr;
+    if (op->state != OP_IDLE) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    *op = (struct ucomm_op){
+        .buffer = (uint8_t*)buffer,
+        .length = length,
+        .state = OP_PENDING,
+        .cb = cb,
+        .arg = arg,
+    };
+    // output buffer is rarely full
+    op_write(pp);
+    return 0;
+}
+
+int ucomm_stats(intptr_t fd, UCOMM_STATS* st)
+{
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    *st = pp->stats;
+    return 0;
+}
+
+int ucomm_latency(intptr_t fd, UCOMM_LATENCY* lat)
+{
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    *lat = pp->lat;
+    return 0;
+}
+
+int ucomm_restore(intptr_t fd)
+{
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    restore_latency(pp);
+    return 0;
+}
+
+int ucomm_cancel(intptr_t fd)
+{
+    struct ucomm_port* pp = port_get(fd);
+    if (pp == NULL)
+        return -1;
+    pp->rd.state = pp->wr.state = OP_IDLE;
+    return 0;
+}
+
+int ucomm_run(intptr_t loop, int ms)
+{
+    struct ucomm_loop* lp = (struct ucomm_loop*)loop;
+    int64_t start = now_ms();
+    for (;;) {
+        // expire reads and find next timeout (ports of this loop only)
+        int64_t now = now_ms();
+        int64_t next = (ms < 0) ? INT64_MAX : start + ms;
+        int pending = 0;
+        for (struct ucomm_port* pp = lp->ports; pp != NULL; pp = pp->next) {
+            if (pp->rd.state == OP_PENDING) {
+                if (now >= pp->rd.expire)
+                    op_finish(pp, &pp->rd, pp->rd.done);
+                else if (pp->rd.expire < next)
+                    next = pp->rd.expire;
+            }
+            pending |= (pp->rd.state == OP_PENDING) || (pp->wr.state == OP_PENDING);
+        }
+
+        int n = dispatch(lp);
+        if (n > 0)
+            return n;
+        if (ms < 0 ? !pending : now >= start + ms)
+            return 0;
+
+        struct epoll_event ev[16];
+        int nev = epoll_wait(lp->epfd, ev, sizeof(ev) / sizeof(ev[0]),
+            (next == INT64_MAX) ? -1 : (int)(next - now));
+        if (nev < 0 && errno != EINTR)
+            return -1;
+        for (int i = 0; i < nev; ++i) {
+            // edge: remember readiness, even with nothing pending
+            struct ucomm_port* pp = (struct ucomm_port*)ev[i].data.ptr;
+            uint32_t events = ev[i].events;
+            if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                pp->readable = 1;
+            if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                pp->writable = 1;
+            if (pp->rd.state == OP_PENDING)
+                op_read(pp);
+            if (pp->wr.state == OP_PENDING)
+                op_write(pp);
+        }
+    }
 }
+#endif // UCOMM_ASYNC
@@ -17,11 +17,24 @@ extern "C" {
 #endif
 
 #define UCOMM_DEFAULT_TIMEOUT 300
+// config flag: minimize USB-serial latency (Linux only)
+#define UCOMM_LOWLATENCY 0x1000
+
+#if defined(__linux__)
+#define UCOMM_ASYNC
+#endif
 
 // open port (blocking write only)
+// return handle or -1 on error
+// note: handle is opaque (on Linux a pointer, not a file descriptor), so compare it
+// with -1, never test its sign
 intptr_t ucomm_open(const char* port, unsigned baud, unsigned config);
 // // 115200 bps 8-N-1
 // intptr_t fd = ucomm_open("/dev/ttyUSB0", 115200, 0x801);
+// if (fd == -1)
+//     perror("ucomm_open");
+// // same w/ ASYNC_LOW_LATENCY and 1 ms latency timer (restored on close)
+// intptr_t fd = ucomm_open("/dev/ttyUSB0", 115200, 0x801 | UCOMM_LOWLATENCY);
 
 // close port
 int ucomm_close(intptr_t fd);
@@ -29,13 +42,21 @@ int ucomm_close(intptr_t fd);
 // reset port configuration (also, discard I/O buffers)
 int ucomm_reset(intptr_t fd, unsigned baud, unsigned config);
 
+// get actual baud rate
+// note: on Linux any rate is set exactly, otherwise the nearest standard is used
+unsigned ucomm_baud(intptr_t fd);
+
 // discard I/O buffers
 int ucomm_purge(intptr_t fd);
 
 // set timeout (0 for immediate return)
-// note: on __unix__ timeout is rounded up to 100 ms
+// note: on __unix__ (except Linux) timeout is rounded up to 100 ms
 int ucomm_timeout(intptr_t fd, unsigned ms);
 
+// set max. total time of ucomm_read() or ucomm_submit_read() (0 for none)
+// unlike timeout, it is not restarted by incoming data (Linux only)
+int ucomm_deadline(intptr_t fd, unsigned ms);
+
 // set DTR and RTS (Cf. "set" means pulldown)
 int ucomm_dtr(intptr_t fd, int pulldown);
 int ucomm_rts(intptr_t fd, int pulldown);
@@ -51,6 +72,93 @@ int ucomm_putc(intptr_t fd, int ch);
 ssize_t ucomm_read(intptr_t fd, void* buffer, size_t length);
 ssize_t ucomm_write(intptr_t fd, const void* buffer, size_t length);
 
+// write several buffers at once (gather write)
+// note: more than UCOMM_IOV_MAX buffers are sent in several writes
+#define UCOMM_IOV_MAX 16
+typedef struct {
+    const void* buffer;
+    size_t length;
+} UCOMM_IOV;
+ssize_t ucomm_writev(intptr_t fd, const UCOMM_IOV* iov, int cnt);
+// UCOMM_IOV iov[] = { { header, 4 }, { page, 128 }, { " ", 1 } };
+// ucomm_writev(fd, iov, 3);
+
+// record every byte sent and received to file (NULL stops), Linux only
+// note: timestamps are monotonic (us), costs nothing while stopped; records are
+// written unbuffered, recording stops at the first write error and stopping then
+// fails with its errno
+int ucomm_trace(intptr_t fd, const char* fname);
+// open recorded trace in place of port (blocking calls only), Linux only
+// note: input is returned at recorded time, output must match or fails with EPROTO
+intptr_t ucomm_replay(const char* fname);
+// intptr_t fd = ucomm_open("/dev/ttyUSB0", 115200, 0x801);
+// ucomm_trace(fd, "session.trace");
+// ...
+// ucomm_close(fd);
+// intptr_t fd = ucomm_replay("session.trace");
+// trace file offset where replayed output first differed, -1 if none (or no replay)
+ssize_t ucomm_diverged(intptr_t fd);
+
+#if defined(UCOMM_ASYNC)
+// asynchronous I/O (Linux only)
+// note: handles are opaque (not file descriptors) and there is no global state, so
+// each loop with its ports may be driven by a different thread
+// result is number of bytes transferred or -1 on error
+typedef void (*UCOMM_CALLBACK)(intptr_t fd, ssize_t result, void* arg);
+
+// create/close event loop (-1 on error)
+// note: close fails with EBUSY until all its ports are closed
+intptr_t ucomm_loop(void);
+int ucomm_loop_close(intptr_t loop);
+
+// open port driven by event loop
+// note: blocking calls on such port may call back other ports of the same loop
+intptr_t ucomm_open_async(intptr_t loop, const char* port, unsigned baud,
+    unsigned config);
+
+// submit write (at most one per port)
+int ucomm_submit_write(intptr_t fd, const void* buffer, size_t length,
+    UCOMM_CALLBACK cb, void* arg);
+
+// arm read (at most one per port)
+// done when length bytes arrived or no data for ms milliseconds
+int ucomm_submit_read(intptr_t fd, void* buffer, size_t length, unsigned ms,
+    UCOMM_CALLBACK cb, void* arg);
+
+// I/O counters
+typedef struct {
+    size_t reads, writes;       // read() and write() calls
+    size_t saved;               // reads served from read-ahead buffer
+} UCOMM_STATS;
+int ucomm_stats(intptr_t fd, UCOMM_STATS* st);
+
+// settings applied by UCOMM_LOWLATENCY
+typedef struct {
+    int async_low_latency;      // 1 set, 0 failed, -1 not supported
+    int latency_timer;          // ms (-1 not available)
+    int old_latency_timer;
+} UCOMM_LATENCY;
+int ucomm_latency(intptr_t fd, UCOMM_LATENCY* lat);
+// undo UCOMM_LOWLATENCY settings before ucomm_close() does (e.g., on exit);
+// async-signal-safe, so it may be called from a signal handler
+int ucomm_restore(intptr_t fd);
+
+// cancel pending operations (no callbacks)
+int ucomm_cancel(intptr_t fd);
+
+// wait for events up to ms milliseconds (-1 until nothing is pending)
+// return number of completed operations (0 on timeout) or -1 on error
+int ucomm_run(intptr_t loop, int ms);
+// intptr_t loop = ucomm_loop();
+// intptr_t fd = ucomm_open_async(loop, "/dev/ttyUSB0", 115200, 0x801);
+// ucomm_submit_write(fd, "0 ", 2, NULL, NULL);
+// ucomm_submit_read(fd, resp, 2, 300, on_reply, ctx);
+// while (ucomm_run(loop, -1) > 0)
+//     ;
+// ucomm_close(fd);
+// ucomm_loop_close(loop);
+#endif // UCOMM_ASYNC
+
 // get ports list (in ucomm_ports.c)
 size_t ucomm_ports(char*** ports);
 // char** ports;